@@ -0,0 +1,155 @@
+#ifndef ORMPP_BATCH_LOADER_HPP
+#define ORMPP_BATCH_LOADER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "connection_pool.hpp"
+
+namespace ormpp{
+    struct batch_options{
+        //the keys loaded in a window are queried together
+        std::chrono::microseconds window{500};
+        //a batch is queried at once when it has max_batch keys
+        size_t max_batch = 512;
+    };
+
+    struct batch_loader_stats{
+        uint64_t loads = 0;
+        //the loads which share the key of another load in the same batch
+        uint64_t coalesced = 0;
+        uint64_t batches = 0;
+    };
+
+    //collects the concurrent load(key) of many threads and queries them by one get_many, every
+    //caller gets a future of its row. DB is the connection type of the pool, such as dbng<mysql>,
+    //and the table of T must have a key. one batch is queried at a time, the keys loaded during
+    //the query go to the next batch.
+    template<typename DB, typename T, typename K>
+    class batch_loader{
+    public:
+        //key is the key field of T, such as: batch_loader<dbng<mysql>, person, int> loader(pool, &person::id)
+        batch_loader(connection_pool<DB>& pool, K T::* key, batch_options options = {}) :
+            pool_(pool), key_(key), options_(options){
+            thd_ = std::thread([this]{ run(); });
+        }
+
+        batch_loader(const batch_loader&) = delete;
+        batch_loader& operator=(const batch_loader&) = delete;
+
+        //the pending loads are still queried
+        ~batch_loader(){
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                stop_ = true;
+            }
+            cv_.notify_one();
+            thd_.join();
+        }
+
+        //empty if there is no row of the key, the future throws if the query failed
+        std::shared_future<std::optional<T>> load(const K& key){
+            std::unique_lock<std::mutex> lock(mtx_);
+            loads_++;
+            auto it = batch_.find(key);
+            if(it!=batch_.end()){
+                coalesced_++;
+                return it->second.future;
+            }
+
+            if(batch_.empty())
+                deadline_ = std::chrono::steady_clock::now() + options_.window;
+
+            auto& e = batch_[key];
+            e.future = e.promise.get_future().share();
+            auto future = e.future;
+            if(batch_.size()==1||batch_.size()>=options_.max_batch)
+                cv_.notify_one();
+            return future;
+        }
+
+        batch_loader_stats stats(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            return {loads_, coalesced_, batches_};
+        }
+
+    private:
+        struct entry{
+            std::promise<std::optional<T>> promise;
+            std::shared_future<std::optional<T>> future;
+        };
+
+        void run(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            while(true){
+                cv_.wait(lock, [this]{ return stop_||!batch_.empty(); });
+                if(batch_.empty())
+                    return;
+
+                cv_.wait_until(lock, deadline_, [this]{ return stop_||batch_.size()>=options_.max_batch; });
+                auto batch = std::move(batch_);
+                batch_.clear();
+                batches_++;
+                lock.unlock();
+                dispatch(batch);
+                lock.lock();
+            }
+        }
+
+        void dispatch(std::map<K, entry>& batch){
+            std::vector<K> keys;
+            keys.reserve(batch.size());
+            for (auto& e : batch) {
+                keys.push_back(e.first);
+            }
+
+            try{
+                auto conn = pool_.get();
+                if(conn==nullptr)
+                    throw std::runtime_error("batch_loader: no available connection");
+
+                conn_guard<DB> guard(conn, pool_);
+                auto rows = conn->template get_many<T>(keys);
+                for (auto& row : rows) {
+                    auto it = batch.find(row.*key_);
+                    if(it!=batch.end()){
+                        it->second.promise.set_value(std::move(row));
+                        batch.erase(it);
+                    }
+                }
+
+                for (auto& e : batch) {
+                    e.second.promise.set_value(std::nullopt);
+                }
+            }
+            catch(...){
+                for (auto& e : batch) {
+                    e.second.promise.set_exception(std::current_exception());
+                }
+            }
+        }
+
+        connection_pool<DB>& pool_;
+        K T::* key_;
+        batch_options options_;
+
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        std::map<K, entry> batch_;
+        std::chrono::steady_clock::time_point deadline_;
+        bool stop_ = false;
+        uint64_t loads_ = 0;
+        uint64_t coalesced_ = 0;
+        uint64_t batches_ = 0;
+        std::thread thd_;
+    };
+}
+
+#endif //ORMPP_BATCH_LOADER_HPP
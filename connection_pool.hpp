@@ -5,15 +5,55 @@
 #ifndef ORMPP_CONNECTION_POOL_HPP
 #define ORMPP_CONNECTION_POOL_HPP
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <map>
+#include <random>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
+#include "mpmc_queue.hpp"
+#include "pool_metrics.hpp"
 
 namespace ormpp{
+    struct pool_options{
+        //how often the maintenance thread checks the idle connections
+        std::chrono::seconds maintain_interval{30};
+        //an idle connection is pinged when it hasn't been used for keepalive_time
+        std::chrono::seconds keepalive_time{300};
+        //a connection is reconnected after max_lifetime minus a random jitter, 0 means never
+        std::chrono::seconds max_lifetime{6*3600};
+        std::chrono::seconds lifetime_jitter{300};
+        //the pool keeps at least min_idle connections and grows on demand up to the max size of
+        //init, -1 means min_idle equals the max size, so the pool has a fixed size.
+        int min_idle = -1;
+        //the idle connections more than min_idle are closed after idle_timeout
+        std::chrono::seconds idle_timeout{600};
+        //how many connections can be created at the same time
+        int max_creating = 4;
+        //get returns nullptr if there is no connection in get_timeout
+        std::chrono::milliseconds get_timeout{3000};
+        //how many threads open the initial connections
+        int init_threads = 8;
+    };
+
+    struct pool_init_result{
+        int connected = 0;
+        int failed = 0;
+        //the first error
+        std::string error;
+
+        bool ok() const{
+            return failed==0;
+        }
+    };
+
     template<typename DB>
     class connection_pool{
     public:
@@ -22,96 +62,451 @@ namespace ormpp{
             return instance;
         }
 
-        //call_once
+        //the named pools of the same DB type, every one has its own connect arguments and sizing,
+        //for example the primary and the analytics databases. created at the first time.
+        static connection_pool<DB>& instance(const std::string& name){
+            static std::mutex mtx;
+            static std::map<std::string, std::unique_ptr<connection_pool<DB>>> pools;
+            std::unique_lock<std::mutex> lock(mtx);
+            auto& pool = pools[name];
+            if(pool==nullptr)
+                pool = std::make_unique<connection_pool<DB>>();
+            return *pool;
+        }
+
+        //a pool can also be owned by the user instead of instance()
+        connection_pool()= default;
+        ~connection_pool(){
+            {
+                std::unique_lock<std::mutex> lock(maintain_mutex_);
+                stop_ = true;
+            }
+            maintain_condition_.notify_one();
+            if(maintain_thread_.joinable())
+                maintain_thread_.join();
+        }
+        connection_pool(const connection_pool&)= delete;
+        connection_pool& operator=(const connection_pool&)= delete;
+
+        //the idle connections are spread over shards, a thread takes from its own shard first and
+        //steals from the others when it is empty, 0 means one shard per hardware thread.
+        //must be called before init, the default is one shard.
+        void set_shards(size_t num){
+            if(num==0)
+                num = (std::max)(1u, std::thread::hardware_concurrency());
+            shard_num_ = num;
+        }
+
+        //must be called before init
+        void set_options(const pool_options& options){
+            options_ = options;
+        }
+
+        //called on every new connection before it is put into the pool, for example to prepare
+        //the hot statements, the connection is dropped if it throws. must be called before init.
+        void set_warm_up(std::function<void(DB&)> warm_up){
+            warm_up_ = std::move(warm_up);
+        }
+
+        //call_once, the initial connections are opened concurrently, the failed ones don't stop
+        //the others and the pool grows later on demand, so check the result.
         template<typename... Args>
-        void init(int maxsize, Args&&... args){
+        pool_init_result init(int maxsize, Args&&... args){
             std::call_once(flag_, &connection_pool<DB>::template init_impl<Args...>, this, maxsize, std::forward<Args>(args)...);
+            return init_result_;
         }
 
+        //the connections are checked by the maintenance thread, so here is just a pop,
+        //a new connection is created if there is no idle one and the pool isn't full.
         std::shared_ptr<DB> get(){
-            std::unique_lock<std::mutex> lock( mutex_ );
-
-            while ( pool_.empty() ){
-                if(condition_.wait_for(lock, std::chrono::seconds(3))== std::cv_status::timeout){
-                    //timeout
-                    return nullptr;
-                }
+            std::shared_ptr<DB> conn;
+            if(try_pop(conn)){
+                metrics_.acquire_wait.record(0);
             }
+            else{
+                auto begin = std::chrono::steady_clock::now();
+                uint64_t released = released_.load();
+                if((conn = grow())==nullptr){
+                    //every shard is empty, wait for a connection returned or a place freed by a dropped one
+                    auto deadline = begin + options_.get_timeout;
+                    std::unique_lock<std::mutex> lock( mutex_ );
+                    waiters_++;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    while(condition_.wait_until(lock, deadline, [this, &conn, released]{
+                        return try_pop(conn)||released_.load()!=released;
+                    })){
+                        if(conn!=nullptr)
+                            break;
 
-            auto conn = pool_.front();
-            pool_.pop_front();
-            lock.unlock();
-
-			if (conn==nullptr||!conn->ping()) {
-				return create_connection();
-			}
-
-            //check timeout, idle time shuold less than 8 hours
-            auto now = std::chrono::system_clock::now();
-            auto last = conn->get_latest_operate_time();
-            auto mins = std::chrono::duration_cast<std::chrono::minutes>(now - last).count();
-            if((mins-6*60)>0){
-                return create_connection();
+                        released = released_.load();
+                        lock.unlock();
+                        conn = grow();
+                        lock.lock();
+                        if(conn!=nullptr)
+                            break;
+                    }
+                    waiters_--;
+                    if(conn==nullptr){
+                        //timeout
+                        pool_metrics::add(metrics_.timeouts);
+                        metrics_.acquire_wait.record(pool_metrics::micros_since(begin));
+                        return nullptr;
+                    }
+                }
+                metrics_.acquire_wait.record(pool_metrics::micros_since(begin));
             }
 
+            pool_metrics::add(metrics_.acquires);
+            if(auto deleter = std::get_deleter<conn_deleter>(conn))
+                deleter->acquire_time = std::chrono::steady_clock::now();
             conn->update_operate_time();
             return conn;
         }
 
         void return_back(std::shared_ptr<DB> conn){
+            if(conn!=nullptr){
+                if(auto deleter = std::get_deleter<conn_deleter>(conn))
+                    metrics_.hold_time.record(pool_metrics::micros_since(deleter->acquire_time));
+            }
+
 			if (conn == nullptr||conn->has_error()) {
-				conn = create_connection();
+                pool_metrics::add(metrics_.broken);
+                //dropped, the maintenance thread fills the pool up to min_idle again
+                release();
+                std::unique_lock<std::mutex> lock(maintain_mutex_);
+                need_fill_ = true;
+                lock.unlock();
+                maintain_condition_.notify_one();
+                return;
 			}
-            std::unique_lock<std::mutex> lock( mutex_ );
-            pool_.push_back( conn );
-            lock.unlock();
-            condition_.notify_one();
+
+            //the keepalive and the idle timeout are counted from the last use
+            conn->update_operate_time();
+            push(std::move(conn));
+        }
+
+        //all the connections, including the ones in use
+        size_t size() const{
+            return total_.load();
+        }
+
+        size_t idle_size() const{
+            size_t num = 0;
+            for (auto& s : shards_) {
+                num += s->queue.size();
+            }
+            return num;
+        }
+
+        //the counters only cost relaxed atomic increments, they are summed up here
+        pool_stats stats() const{
+            pool_stats s;
+            metrics_.fill(s);
+            s.size = size();
+            s.idle = idle_size();
+            s.in_use = s.size>s.idle ? s.size - s.idle : 0;
+            s.waiters = waiters_.load();
+            return s;
         }
     private:
         template<typename... Args>
         void init_impl(int maxsize, Args&&... args){
-            args_ = std::make_tuple(std::forward<Args>(args)...);
+            //the arguments are copied, so any type accepted by DB::connect can be used
+            connect_ = [tp = std::make_tuple(std::decay_t<Args>(args)...)](DB& db){
+                return std::apply([&db](const auto&... targs){
+                    return db.connect(targs...);
+                }, tp);
+            };
+
+            max_total_ = maxsize;
+            min_idle_ = options_.min_idle<0 ? maxsize : (std::min)(options_.min_idle, maxsize);
+
+            //every shard can hold all the connections, so returning back never fails
+            for (size_t i = 0; i < shard_num_; ++i) {
+                shards_.emplace_back(std::make_unique<shard>(maxsize));
+            }
+
+            std::atomic<int> next = 0;
+            std::mutex mtx;
+            auto open = [this, &next, &mtx]{
+                for (int i = next++; i < min_idle_; i = next++) {
+                    std::string error;
+                    auto conn = create_connection(&error);
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if(conn!=nullptr){
+                        shards_[i % shard_num_]->queue.try_push(std::move(conn));
+                        total_++;
+                        init_result_.connected++;
+                    }
+                    else{
+                        if(init_result_.failed==0)
+                            init_result_.error = error;
+                        init_result_.failed++;
+                    }
+                }
+            };
+
+            int thread_num = (std::min)((std::max)(options_.init_threads, 1), min_idle_);
+            std::vector<std::thread> threads;
+            for (int i = 1; i < thread_num; ++i) {
+                threads.emplace_back(open);
+            }
+            open();
+            for (auto& thd : threads) {
+                thd.join();
+            }
+
+            if(init_result_.failed>0){
+                init_result_.error = std::to_string(init_result_.failed) + " of " + std::to_string(min_idle_) +
+                    " connections failed, the first error: " + init_result_.error;
+            }
+
+            maintain_thread_ = std::thread([this]{ maintain(); });
+        }
+
+        size_t shard_index() const{
+            static thread_local size_t index = std::hash<std::thread::id>{}(std::this_thread::get_id());
+            return index % shard_num_;
+        }
+
+        bool try_pop(std::shared_ptr<DB>& conn){
+            size_t index = shard_index();
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                if(shards_[(index + i) % shards_.size()]->queue.try_pop(conn))
+                    return true;
+            }
+
+            return false;
+        }
+
+        void push(std::shared_ptr<DB>&& conn){
+            push(std::move(conn), shard_index());
+        }
+
+        void push(std::shared_ptr<DB>&& conn, size_t index){
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                if(shards_[(index + i) % shards_.size()]->queue.try_push(std::move(conn)))
+                    break;
+            }
+
+            notify_waiter();
+        }
+
+        //a connection is dropped, a waiter may create a new one in its place
+        void release(){
+            total_--;
+            released_++;
+            notify_waiter();
+        }
+
+        void notify_waiter(){
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(waiters_.load()>0){
+                //the waiter checks the shards with the mutex locked, so it won't miss the notification
+                std::unique_lock<std::mutex> lock( mutex_ );
+                lock.unlock();
+                condition_.notify_one();
+            }
+        }
 
-            for (int i = 0; i < maxsize; ++i) {
-                auto conn = std::make_shared<DB>();
-                if(conn->connect(std::forward<Args>(args)...)){
-                    pool_.push_back(conn);
+        //reserve a place in the pool and create a connection, returns nullptr when the pool is full,
+        //too many connections are being created or the connection fails.
+        std::shared_ptr<DB> grow(){
+            int creating = creating_.load();
+            do{
+                if(creating>=options_.max_creating)
+                    return nullptr;
+            }while(!creating_.compare_exchange_weak(creating, creating + 1));
+
+            size_t total = total_.load();
+            do{
+                if(total>=(size_t)max_total_){
+                    creating_--;
+                    return nullptr;
                 }
-                else{
-                    throw std::invalid_argument("init failed");
+            }while(!total_.compare_exchange_weak(total, total + 1));
+
+            auto conn = create_connection();
+            creating_--;
+            if(conn==nullptr)
+                total_--;
+
+            return conn;
+        }
+
+        bool fill_min_idle(){
+            while(total_.load()<(size_t)min_idle_){
+                auto conn = grow();
+                if(conn==nullptr)
+                    return total_.load()>=(size_t)min_idle_;
+                push(std::move(conn));
+            }
+
+            return true;
+        }
+
+        void maintain(){
+            std::unique_lock<std::mutex> lock(maintain_mutex_);
+            bool failed = false;
+            while(!stop_){
+                //don't retry at once when the server can't be connected
+                maintain_condition_.wait_for(lock, options_.maintain_interval, [this, failed]{
+                    return stop_||(!failed&&need_fill_);
+                });
+                if(stop_)
+                    break;
+
+                need_fill_ = false;
+                lock.unlock();
+
+                check_idle_connections();
+                failed = !fill_min_idle();
+
+                lock.lock();
+            }
+        }
+
+        //every idle connection is taken out once, recycled when it is too old, pinged when it has
+        //been idle for keepalive_time and rebuilt when the ping fails. the connections more than
+        //min_idle are closed when they have been idle for idle_timeout.
+        void check_idle_connections(){
+            auto now = std::chrono::system_clock::now();
+            size_t idle = idle_size();
+            for (size_t index = 0; index < shards_.size(); ++index) {
+                auto& s = shards_[index];
+                size_t num = s->queue.size();
+                for (size_t i = 0; i < num; ++i) {
+                    std::shared_ptr<DB> conn;
+                    if(!s->queue.try_pop(conn))
+                        break;
+
+                    auto idle_time = now - conn->get_latest_operate_time();
+                    if(idle>(size_t)min_idle_&&idle_time>=options_.idle_timeout){
+                        idle--;
+                        release();
+                        pool_metrics::add(metrics_.trimmed);
+                        continue;
+                    }
+
+                    bool healthy = true;
+                    auto deleter = std::get_deleter<conn_deleter>(conn);
+                    if(deleter!=nullptr&&now>=deleter->expire_time){
+                        healthy = false;
+                    }
+                    else if(idle_time>=options_.keepalive_time){
+                        healthy = ping(*conn);
+                        conn->update_operate_time();
+                    }
+
+                    if(!healthy){
+                        auto new_conn = create_connection();
+                        if(new_conn!=nullptr){
+                            conn = std::move(new_conn);
+                            pool_metrics::add(metrics_.reconnects);
+                        }
+                        else if(!ping(*conn)){
+                            idle--;
+                            release();
+                            continue;
+                        }
+                    }
+
+                    push(std::move(conn), index);
                 }
             }
         }
 
-        auto create_connection(){
-            auto conn = std::make_shared<DB>();
-            auto fn = [conn](auto... targs){
-                return conn->connect(targs...);
-            };
+        bool ping(DB& conn){
+            pool_metrics::add(metrics_.pings);
+            bool r = conn.ping();
+            if(!r)
+                pool_metrics::add(metrics_.ping_failures);
+            return r;
+        }
+
+        struct conn_deleter{
+            std::chrono::system_clock::time_point expire_time;
+            std::chrono::steady_clock::time_point acquire_time{};
+            void operator()(DB* p) const{
+                delete p;
+            }
+        };
+
+        //the expire time is kept in the deleter of the shared_ptr, std::get_deleter finds it
+        std::shared_ptr<DB> create_connection(std::string* error = nullptr){
+            auto expire = std::chrono::system_clock::time_point::max();
+            if(options_.max_lifetime.count()>0){
+                static thread_local std::mt19937 gen{std::random_device{}()};
+                auto jitter = options_.lifetime_jitter.count()>0 ?
+                    std::uniform_int_distribution<long long>(0, options_.lifetime_jitter.count())(gen) : 0;
+                expire = std::chrono::system_clock::now() + options_.max_lifetime - std::chrono::seconds(jitter);
+            }
+
+            std::shared_ptr<DB> conn(new DB(), conn_deleter{expire});
+            if(!connect_(*conn)){
+                pool_metrics::add(metrics_.create_failures);
+                if(error!=nullptr)
+                    *error = "connect failed";
+                return nullptr;
+            }
+
+            if(warm_up_){
+                try{
+                    warm_up_(*conn);
+                }
+                catch(const std::exception& e){
+                    pool_metrics::add(metrics_.create_failures);
+                    if(error!=nullptr)
+                        *error = std::string("warm up failed: ") + e.what();
+                    return nullptr;
+                }
+            }
 
-            return std::apply(fn, args_)? conn: nullptr;
+            pool_metrics::add(metrics_.created);
+            return conn;
         }
 
-        connection_pool()= default;
-        ~connection_pool()= default;
-        connection_pool(const connection_pool&)= delete;
-        connection_pool& operator=(const connection_pool&)= delete;
+        struct alignas(64) shard{
+            explicit shard(size_t capacity) : queue(capacity){}
+            mpmc_queue<std::shared_ptr<DB>> queue;
+        };
 
-        std::deque<std::shared_ptr<DB>> pool_;
+        std::vector<std::unique_ptr<shard>> shards_;
+        size_t shard_num_ = 1;
+        std::atomic<int> waiters_{0};
+        //counts the dropped connections, to wake up the waiters
+        std::atomic<uint64_t> released_{0};
         std::mutex mutex_;
         std::condition_variable condition_;
         std::once_flag flag_;
-        std::tuple<const char*, const char*, const char*, const char*, int> args_;
+        std::function<bool(DB&)> connect_;
+
+        pool_options options_;
+        std::function<void(DB&)> warm_up_;
+        pool_init_result init_result_;
+        std::thread maintain_thread_;
+        std::mutex maintain_mutex_;
+        std::condition_variable maintain_condition_;
+        bool need_fill_ = false;
+        bool stop_ = false;
+
+        int max_total_ = 0;
+        int min_idle_ = 0;
+        std::atomic<size_t> total_{0};
+        std::atomic<int> creating_{0};
+        pool_metrics metrics_;
     };
 
     template<typename DB>
     struct conn_guard{
-        conn_guard(std::shared_ptr<DB> con) : conn_(con){}
+        conn_guard(std::shared_ptr<DB> con, connection_pool<DB>& pool = connection_pool<DB>::instance()) :
+            conn_(con), pool_(pool){}
         ~conn_guard(){
-			connection_pool<DB>::instance().return_back(conn_.lock());
+			pool_.return_back(conn_.lock());
         }
     private:
         std::weak_ptr<DB> conn_;
+        connection_pool<DB>& pool_;
     };
 }
 
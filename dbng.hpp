@@ -10,7 +10,11 @@
 #include <vector>
 #include <functional>
 #include <chrono>
+#include <optional>
 #include "utility.hpp"
+#include "tracked.hpp"
+#include "query_cache.hpp"
+#include "entity_cache.hpp"
 
 namespace ormpp{
     template<typename DB>
@@ -45,35 +49,130 @@ namespace ormpp{
 
         template<typename T, typename... Args>
         int insert(const T& t,Args&&... args){
-            return db_.insert(t, std::forward<Args>(args)...);
+            return write(&t, 1, false, [&]{ return db_.insert(t, std::forward<Args>(args)...); });
         }
 
         template<typename T, typename... Args>
         int insert(const std::vector<T>& t, Args&&... args){
-            return db_.insert(t, std::forward<Args>(args)...);
+            return write(t.data(), t.size(), false, [&]{ return db_.insert(t, std::forward<Args>(args)...); });
         }
 
         template<typename T, typename... Args>
         int update(const T& t, Args&&... args) {
-            return db_.update(t, std::forward<Args>(args)...);
+            return write(&t, 1, true, [&]{ return db_.update(t, std::forward<Args>(args)...); });
         }
 
         template<typename T, typename... Args>
         int update(const std::vector<T>& t, Args&&... args){
-            return db_.update(t, std::forward<Args>(args)...);
+            return write(t.data(), t.size(), true, [&]{ return db_.update(t, std::forward<Args>(args)...); });
+        }
+
+        //only the changed fields of the row are updated by its key, then the row is unchanged again if
+        //one row is updated. returns 0 if nothing is changed, fails if the key is changed.
+        template<typename T>
+        int update(tracked<T>& t){
+            auto mask = t.dirty_mask();
+            if(mask==0)
+                return 0;
+
+            int r = write(&t.get(), 1, false, [&]{ return db_.update_fields(t.get(), mask); });
+            if(r==1)
+                t.reset();
+            return r;
+        }
+
+        //insert the row, or update it if its key exists, in one statement. the fields to update can be
+        //chosen, such as: upsert(p, FID(person::age)), all the fields except the key by default
+        template<typename T, typename... Fields>
+        int upsert(const T& t, Fields... fields){
+            return write(&t, 1, false, [&]{ return db_.upsert(t, std::vector<std::string_view>{fields.first...}); });
+        }
+
+        template<typename T, typename... Fields>
+        int upsert(const std::vector<T>& v, Fields... fields){
+            return write(v.data(), v.size(), false, [&]{ return db_.upsert(v, std::vector<std::string_view>{fields.first...}); });
         }
 
         template<typename T, typename... Args>
         bool delete_records(Args&&... where_conditon){
-            return db_.template delete_records<T>(std::forward<Args>(where_conditon)...);
+            //the deleted keys are unknown, so the whole table is invalidated
+            return write<T>(nullptr, 0, false, [&]{ return db_.template delete_records<T>(std::forward<Args>(where_conditon)...); });
         }
 
         //restriction, all the args are string, the first is the where condition, rest are append conditions
         template<typename T, typename... Args>
         std::vector<T> query(Args&&... args){
+            //a transaction may read its own uncommitted rows, they aren't shared by the cache
+            if constexpr(iguana::is_reflection_v<T>){
+                if(cache_!=nullptr&&!in_transaction_&&cache_->is_cached<T>())
+                    return cached_query<T>(std::forward<Args>(args)...);
+            }
+
             return db_.template query<T>(std::forward<Args>(args)...);
         }
 
+        //the results of query<T> are cached for the types with a ttl in the cache, the writes through
+        //this dbng invalidate the tables and the queries in a transaction bypass the cache. the cache
+        //can be shared by many dbng, nullptr to stop it.
+        void set_query_cache(query_cache* cache){
+            cache_ = cache;
+        }
+
+        //get and get_many are served from the cache for the types added to it, update writes the rows
+        //through and the other writes drop them. a transaction bypasses the cache. the cache can be
+        //shared by many dbng, nullptr to stop it.
+        void set_entity_cache(entity_cache* cache){
+            entities_ = cache;
+        }
+
+        //the row of the key, by a cached prepared statement. the table must be created with ormpp_key
+        //or ormpp_auto_key, such as: get<person>(1)
+        template<typename T, typename K>
+        std::optional<T> get(const K& key){
+            using key_type = std::conditional_t<std::is_arithmetic_v<K>, K, std::string>;
+            auto v = get_many<T>(std::vector<key_type>{key_type(key)});
+            if(v.empty())
+                return {};
+            return std::move(v[0]);
+        }
+
+        //the rows of the keys, in no particular order, the keys are sent in batches of 1, 8, 64 or 512
+        template<typename T, typename K>
+        std::vector<T> get_many(const std::vector<K>& keys){
+            //a transaction may read its own uncommitted rows, they aren't shared by the cache
+            if(entities_==nullptr||in_transaction_||!entities_->is_cached<T>())
+                return db_.template get_many<T>(keys);
+
+            std::vector<T> v;
+            std::vector<K> missing;
+            std::vector<uint64_t> versions;
+            for (auto& key : keys) {
+                T t{};
+                if(entities_->get(key, t)){
+                    v.push_back(std::move(t));
+                }
+                else{
+                    missing.push_back(key);
+                    versions.push_back(entities_->version<T>(key));
+                }
+            }
+
+            if(missing.empty())
+                return v;
+
+            auto rows = db_.template get_many<T>(missing);
+            entities_->fill(rows, missing, versions);
+            v.insert(v.end(), std::make_move_iterator(rows.begin()), std::make_move_iterator(rows.end()));
+            return v;
+        }
+
+        //visit the rows one by one in bounded memory, f(T&) may return false to stop, mysql and postgresql
+        //returns the count of the visited rows, postgresql returns -1 if the query fails, mysql throws
+        template<typename T, typename F, typename... Args>
+        int64_t query_stream(F&& f, Args&&... args){
+            return db_.template query_stream<T>(std::forward<F>(f), std::forward<Args>(args)...);
+        }
+
         //support member variable, such as: query(FID(simple::id), "<", 5)
         template<typename Pair, typename U>
         auto query(Pair pair, std::string_view oper, U&& val){
@@ -89,8 +188,19 @@ namespace ormpp{
             return delete_records<T>(sql);
         }
 
+        //the tables of a raw sql are unknown, so all the cached results are invalidated after it
         bool execute(const std::string& sql){
-            return db_.execute(sql);
+            bool r;
+            try{
+                r = db_.execute(sql);
+            }
+            catch(...){
+                invalidate_all();
+                throw;
+            }
+
+            invalidate_all();
+            return r;
         }
 
         //transaction
@@ -98,6 +208,7 @@ namespace ormpp{
 			try
 			{
                 db_.begin();
+                in_transaction_ = true;
 				return true;
 			}
 			catch (std::exception& e)
@@ -113,6 +224,7 @@ namespace ormpp{
 			try
 			{
                 db_.commit();
+                end_transaction();
 				return true;
 			}
 			catch (std::exception& e)
@@ -125,6 +237,7 @@ namespace ormpp{
             try
             {
                  db_.rollback();
+                 end_transaction();
                  return true;
             }
             catch (std::exception& e)
@@ -149,7 +262,97 @@ namespace ormpp{
 			return db_.get_last_affect_rows();
 		}
 
+		//prepared statements cached by the connection
+		auto& get_statement_cache() {
+			return db_.get_statement_cache();
+		}
+
+		//mysql only
+		uint64_t get_refetch_count() const {
+			return db_.get_refetch_count();
+		}
+
     private:
+        //keyed by the sql, a failed query isn't cached, neither is an empty result
+        template<typename T, typename... Args>
+        std::vector<T> cached_query(Args&&... args){
+            auto key = generate_query_sql<T>(args...);
+            std::vector<T> v;
+            if(cache_->get(key, v))
+                return v;
+
+            auto version = cache_->version<T>();
+            v = db_.template query<T>(std::forward<Args>(args)...);
+            if(!v.empty())
+                cache_->put(key, version, v);
+            return v;
+        }
+
+        //the other connections may cache the rows before the transaction ends, so the tables are
+        //invalidated again when it ends
+        template<typename T>
+        void invalidate(){
+            if(cache_!=nullptr)
+                cache_->invalidate<T>();
+            if(in_transaction_&&(cache_!=nullptr||entities_!=nullptr))
+                transaction_tables_.push_back(iguana::get_name<T>());
+        }
+
+        void invalidate_all(){
+            if(cache_!=nullptr)
+                cache_->invalidate_all();
+            if(entities_!=nullptr)
+                entities_->invalidate_all();
+            if(in_transaction_)
+                transaction_all_ = true;
+        }
+
+        void end_transaction(){
+            in_transaction_ = false;
+            if(transaction_all_)
+                invalidate_all();
+            for (auto table : transaction_tables_) {
+                if(cache_!=nullptr)
+                    cache_->invalidate(table);
+                if(entities_!=nullptr)
+                    entities_->invalidate(table);
+            }
+            transaction_all_ = false;
+            transaction_tables_.clear();
+        }
+
+        //the caches are invalidated after the write, even if it throws, so the results read while it
+        //runs aren't kept. the rows are also dropped from the entity cache before the write, then
+        //written through after it if through and all of them are written. nothing is written through
+        //in a transaction, it may be rolled back. nullptr rows stand for the whole table.
+        template<typename T, typename F>
+        auto write(const T* rows, size_t n, bool through, F&& f){
+            bool entities = entities_!=nullptr&&entities_->is_cached<T>();
+            std::vector<uint64_t> versions(entities ? n : 0);
+            for (size_t i = 0; i < versions.size(); ++i) {
+                versions[i] = entities_->begin_write(rows[i]);
+            }
+
+            auto finish = [&](bool written){
+                invalidate<T>();
+                if(entities&&rows==nullptr)
+                    entities_->invalidate<T>();
+                for (size_t i = 0; i < versions.size(); ++i) {
+                    entities_->end_write(rows[i], versions[i], written);
+                }
+            };
+
+            try{
+                auto r = f();
+                finish(through&&!in_transaction_&&r==(decltype(r))n);
+                return r;
+            }
+            catch(...){
+                finish(false);
+                throw;
+            }
+        }
+
         template<typename Pair, typename U>
         auto build_condition(Pair pair, std::string_view oper, U&& val){
             std::string sql = "";
@@ -240,6 +443,12 @@ public:\
         }
     private:
         DB db_;
+        query_cache* cache_ = nullptr;
+        entity_cache* entities_ = nullptr;
+        bool in_transaction_ = false;
+        //a raw sql is executed in the transaction
+        bool transaction_all_ = false;
+        std::vector<std::string_view> transaction_tables_;
         std::chrono::system_clock::time_point latest_tm_ = std::chrono::system_clock::now();
     };
 }
@@ -0,0 +1,271 @@
+#ifndef ORMPP_ENTITY_CACHE_HPP
+#define ORMPP_ENTITY_CACHE_HPP
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "iguana/reflection.hpp"
+
+namespace ormpp{
+    struct entity_cache_stats{
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        //removed to keep the cache in its capacity
+        uint64_t evictions = 0;
+        //removed because the row or its table was written
+        uint64_t invalidations = 0;
+        size_t entries = 0;
+    };
+
+    //the rows of the types added to it, keyed by their primary key in lru order: an identity map shared
+    //by the connections of a pool, such as in the warm up of the pool: conn.set_entity_cache(&cache).
+    //dbng::get and get_many are served from it, dbng::update writes the rows through and the other
+    //writes drop them. it is split into shards by the hash of the key, one for a core by default, every
+    //shard has its own lock and lru. the writes by other clients are only seen after the rows are evicted.
+    class entity_cache{
+    public:
+        explicit entity_cache(size_t max_entries = 100000, size_t shards = std::thread::hardware_concurrency()) :
+            shards_((std::max)(shards, size_t(1))){
+            shard_entries_ = (std::max)(max_entries / shards_.size(), size_t(1));
+        }
+
+        entity_cache(const entity_cache&) = delete;
+        entity_cache& operator=(const entity_cache&) = delete;
+
+        //key is the primary key of T, such as: add<person>(&person::id). the types are added before
+        //the cache is used.
+        template<typename T, typename K>
+        void add(K T::* key){
+            types_[iguana::get_name<T>()] = [key](const void* t){
+                return make_key(iguana::get_name<T>(), static_cast<const T*>(t)->*key);
+            };
+        }
+
+        template<typename T>
+        bool is_cached() const{
+            return types_.find(iguana::get_name<T>())!=types_.end();
+        }
+
+        template<typename T, typename K>
+        bool get(const K& key, T& t){
+            auto k = make_key(iguana::get_name<T>(), key);
+            auto& s = get_shard(k);
+            std::unique_lock<std::mutex> lock(s.mtx);
+            auto it = s.entries.find(k);
+            if(it==s.entries.end()){
+                s.misses++;
+                return false;
+            }
+
+            if(it->second->epoch!=s.tables[iguana::get_name<T>()].epoch){
+                s.invalidations++;
+                s.misses++;
+                erase(s, it);
+                return false;
+            }
+
+            s.hits++;
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            t = *std::static_pointer_cast<const T>(it->second->value);
+            return true;
+        }
+
+        //taken before the row of the key is read, the row is only filled if it isn't written during the read
+        template<typename T, typename K>
+        uint64_t version(const K& key){
+            auto& s = get_shard(make_key(iguana::get_name<T>(), key));
+            std::unique_lock<std::mutex> lock(s.mtx);
+            return s.tables[iguana::get_name<T>()].version;
+        }
+
+        //the rows read by the keys, versions[i] is the version of keys[i]
+        template<typename T, typename K>
+        void fill(const std::vector<T>& rows, const std::vector<K>& keys, const std::vector<uint64_t>& versions){
+            std::unordered_map<std::string, uint64_t> key_versions;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                key_versions.emplace(make_key(iguana::get_name<T>(), keys[i]), versions[i]);
+            }
+
+            for (auto& t : rows) {
+                auto k = key_of(t);
+                auto it = key_versions.find(k);
+                if(it==key_versions.end())
+                    continue;
+
+                auto& s = get_shard(k);
+                std::unique_lock<std::mutex> lock(s.mtx);
+                if(s.tables[iguana::get_name<T>()].version==it->second)
+                    put(s, std::move(k), t);
+            }
+        }
+
+        //the row is dropped before it is written, the returned version is given to end_write
+        template<typename T>
+        uint64_t begin_write(const T& t){
+            return drop(key_of(t), iguana::get_name<T>());
+        }
+
+        //the row is kept if through and no other write of the shard happened since begin_write, otherwise
+        //it is dropped again. the version is changed either way, so the rows read during the write aren't kept.
+        template<typename T>
+        void end_write(const T& t, uint64_t version, bool through){
+            auto k = key_of(t);
+            auto& s = get_shard(k);
+            std::unique_lock<std::mutex> lock(s.mtx);
+            auto& table = s.tables[iguana::get_name<T>()];
+            if(through&&table.version==version){
+                table.version++;
+                put(s, std::move(k), t);
+                return;
+            }
+
+            lock.unlock();
+            drop(k, iguana::get_name<T>());
+        }
+
+        //the rows of the table are dropped when they are read
+        template<typename T>
+        void invalidate(){
+            invalidate(iguana::get_name<T>());
+        }
+
+        void invalidate(std::string_view table){
+            for (auto& s : shards_) {
+                std::unique_lock<std::mutex> lock(s.mtx);
+                auto& info = s.tables[table];
+                info.version++;
+                info.epoch++;
+            }
+        }
+
+        //such as after a raw sql is executed
+        void invalidate_all(){
+            for (auto& s : shards_) {
+                std::unique_lock<std::mutex> lock(s.mtx);
+                for (auto& table : s.tables) {
+                    table.second.version++;
+                    table.second.epoch++;
+                }
+            }
+        }
+
+        void clear(){
+            for (auto& s : shards_) {
+                std::unique_lock<std::mutex> lock(s.mtx);
+                s.entries.clear();
+                s.lru.clear();
+            }
+        }
+
+        entity_cache_stats stats(){
+            entity_cache_stats stats;
+            for (auto& s : shards_) {
+                std::unique_lock<std::mutex> lock(s.mtx);
+                stats.hits += s.hits;
+                stats.misses += s.misses;
+                stats.evictions += s.evictions;
+                stats.invalidations += s.invalidations;
+                stats.entries += s.entries.size();
+            }
+            return stats;
+        }
+
+        size_t shard_count() const{
+            return shards_.size();
+        }
+
+    private:
+        struct table_info{
+            //changed by every write of the table in the shard
+            uint64_t version = 0;
+            //changed when the whole table is invalidated
+            uint64_t epoch = 0;
+        };
+
+        struct entry{
+            std::string key;
+            uint64_t epoch;
+            std::shared_ptr<const void> value;
+        };
+
+        using entry_iterator = std::list<entry>::iterator;
+
+        //on its own cache line, so the locks of the shards don't share one
+        struct alignas(64) shard{
+            std::mutex mtx;
+            std::list<entry> lru;
+            std::unordered_map<std::string, entry_iterator> entries;
+            //keyed by the names of the types, which are static
+            std::unordered_map<std::string_view, table_info> tables;
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+            uint64_t invalidations = 0;
+        };
+
+        //the table and the key separated by '\0', which isn't in a table name
+        template<typename K>
+        static std::string make_key(std::string_view table, const K& key){
+            std::string k(table);
+            k.push_back('\0');
+            if constexpr(std::is_arithmetic_v<K>){
+                k += std::to_string(key);
+            }
+            else{
+                k += key;
+            }
+            return k;
+        }
+
+        template<typename T>
+        std::string key_of(const T& t) const{
+            return types_.at(iguana::get_name<T>())(&t);
+        }
+
+        shard& get_shard(const std::string& key){
+            return shards_[std::hash<std::string>{}(key) % shards_.size()];
+        }
+
+        template<typename T>
+        void put(shard& s, std::string key, const T& t){
+            if(auto it = s.entries.find(key); it!=s.entries.end())
+                erase(s, it);
+
+            s.lru.push_front(entry{key, s.tables[iguana::get_name<T>()].epoch, std::make_shared<const T>(t)});
+            s.entries.emplace(std::move(key), s.lru.begin());
+            while(s.entries.size()>shard_entries_){
+                s.evictions++;
+                erase(s, s.entries.find(s.lru.back().key));
+            }
+        }
+
+        uint64_t drop(const std::string& key, std::string_view table){
+            auto& s = get_shard(key);
+            std::unique_lock<std::mutex> lock(s.mtx);
+            if(auto it = s.entries.find(key); it!=s.entries.end()){
+                s.invalidations++;
+                erase(s, it);
+            }
+            return ++s.tables[table].version;
+        }
+
+        static void erase(shard& s, std::unordered_map<std::string, entry_iterator>::iterator it){
+            s.lru.erase(it->second);
+            s.entries.erase(it);
+        }
+
+        std::vector<shard> shards_;
+        size_t shard_entries_;
+        std::unordered_map<std::string_view, std::function<std::string(const void*)>> types_;
+    };
+}
+
+#endif //ORMPP_ENTITY_CACHE_HPP
@@ -23,6 +23,10 @@
 
 #include "dbng.hpp"
 #include "connection_pool.hpp"
+#include "rw_router.hpp"
+#include "sharded_dbng.hpp"
+#include "batch_loader.hpp"
+#include "singleflight.hpp"
 #include "ormpp_cfg.hpp"
 
 #define TEST_MAIN
@@ -218,6 +222,430 @@ TEST_CASE(postgres_pool){
 }
 #endif
 
+//a connection which needn't a server, for measuring the pool itself
+template<int N>
+struct pool_bench_db{
+    template<typename... Args>
+    bool connect(Args&&...){ return true; }
+    bool ping(){ return true; }
+    bool has_error(){ return false; }
+    void update_operate_time(){ latest_tm_ = std::chrono::system_clock::now(); }
+    auto get_latest_operate_time(){ return latest_tm_; }
+    std::chrono::system_clock::time_point latest_tm_ = std::chrono::system_clock::now();
+};
+
+template<typename Pool>
+double pool_contention(Pool& pool, int threads, int times){
+    std::atomic<int> failed = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> v;
+    for (int i = 0; i < threads; ++i) {
+        v.emplace_back([&pool, &failed, times]{
+            for (int j = 0; j < times; ++j) {
+                auto conn = pool.get();
+                if(conn==nullptr){
+                    failed++;
+                    continue;
+                }
+                pool.return_back(conn);
+            }
+        });
+    }
+    for (auto& thd : v) {
+        thd.join();
+    }
+    TEST_CHECK(failed==0);
+
+    auto s = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+    return threads * times / s;
+}
+
+TEST_CASE(pool_maintain){
+    auto& pool = connection_pool<pool_bench_db<2>>::instance();
+    pool.init(1, ip, "root", "12345", "testdb", 2);
+
+    auto conn = pool.get();
+    TEST_REQUIRE(conn!=nullptr);
+    //a broken connection is rebuilt by the maintenance thread
+    pool.return_back(nullptr);
+    TEST_CHECK(pool.get()!=nullptr);
+}
+
+TEST_CASE(pool_elastic){
+    auto& pool = connection_pool<pool_bench_db<3>>::instance();
+    pool_options options;
+    options.min_idle = 1;
+    options.idle_timeout = std::chrono::seconds(0);
+    options.maintain_interval = std::chrono::seconds(1);
+    options.get_timeout = std::chrono::milliseconds(100);
+    pool.set_options(options);
+    pool.init(3, ip, "root", "12345", "testdb", 2);
+    TEST_CHECK(pool.size()==1);
+
+    //grow on demand up to the max size
+    auto conn1 = pool.get();
+    auto conn2 = pool.get();
+    auto conn3 = pool.get();
+    TEST_CHECK(conn3!=nullptr);
+    TEST_CHECK(pool.size()==3);
+    TEST_CHECK(pool.get()==nullptr);
+
+    pool.return_back(conn1);
+    pool.return_back(conn2);
+    pool.return_back(conn3);
+    TEST_CHECK(pool.idle_size()==3);
+
+    //trimmed back to min_idle
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    TEST_CHECK(pool.size()==1);
+
+    //the idle timeout is counted from the return, not from the get
+    auto& pool1 = connection_pool<pool_bench_db<9>>::instance();
+    options.idle_timeout = std::chrono::seconds(1);
+    pool1.set_options(options);
+    pool1.init(2, ip, "root", "12345", "testdb", 2);
+    auto conn4 = pool1.get();
+    auto conn5 = pool1.get();
+    TEST_CHECK(pool1.size()==2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    pool1.return_back(conn4);
+    pool1.return_back(conn5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(800));
+    TEST_CHECK(pool1.size()==2);
+}
+
+TEST_CASE(pool_waiter_grow){
+    auto& pool = connection_pool<pool_bench_db<8>>::instance();
+    pool_options options;
+    options.min_idle = 0;
+    options.get_timeout = std::chrono::milliseconds(1000);
+    pool.set_options(options);
+    pool.init(1, ip, "root", "12345", "testdb", 2);
+
+    auto conn = pool.get();
+    TEST_REQUIRE(conn!=nullptr);
+    auto f = std::async(std::launch::async, [&pool]{ return pool.get(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    //the place of the broken connection is taken by the waiter
+    pool.return_back(nullptr);
+    TEST_CHECK(f.get()!=nullptr);
+}
+
+TEST_CASE(pool_warm_up){
+    std::atomic<int> count = 0;
+    auto& pool = connection_pool<pool_bench_db<4>>::instance();
+    pool.set_warm_up([&count](pool_bench_db<4>&){ count++; });
+    auto result = pool.init(8, ip, "root", "12345", "testdb", 2);
+    TEST_CHECK(result.ok());
+    TEST_CHECK(result.connected==8);
+    TEST_CHECK(count==8);
+
+    //the failed connections don't stop the others
+    std::atomic<int> index = 0;
+    auto& pool1 = connection_pool<pool_bench_db<5>>::instance();
+    pool1.set_warm_up([&index](pool_bench_db<5>&){
+        if(index++%2==0)
+            throw std::runtime_error("warm up error");
+    });
+    auto result1 = pool1.init(8, ip, "root", "12345", "testdb", 2);
+    TEST_CHECK(!result1.ok());
+    TEST_CHECK(result1.connected==4);
+    TEST_CHECK(result1.failed==4);
+    TEST_CHECK(!result1.error.empty());
+}
+
+TEST_CASE(pool_metrics_snapshot){
+    auto& pool = connection_pool<pool_bench_db<6>>::instance();
+    pool_options options;
+    options.get_timeout = std::chrono::milliseconds(10);
+    pool.set_options(options);
+    pool.init(2, ip, "root", "12345", "testdb", 2);
+
+    auto conn1 = pool.get();
+    auto conn2 = pool.get();
+    TEST_CHECK(pool.get()==nullptr);
+    auto s = pool.stats();
+    TEST_CHECK(s.size==2);
+    TEST_CHECK(s.in_use==2);
+    TEST_CHECK(s.acquires==2);
+    TEST_CHECK(s.timeouts==1);
+    TEST_CHECK(s.created==2);
+    TEST_CHECK(s.acquire_wait.count==3);
+    TEST_CHECK(s.acquire_wait.max>=10000);
+
+    pool.return_back(conn1);
+    pool.return_back(conn2);
+    s = pool.stats();
+    TEST_CHECK(s.idle==2);
+    TEST_CHECK(s.hold_time.count==2);
+
+    latency_histogram h;
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        h.record(i);
+    }
+    auto hs = h.snapshot();
+    TEST_CHECK(hs.count==1000);
+    TEST_CHECK(hs.value_at(50)>=500&&hs.value_at(50)<=500*1.13);
+    TEST_CHECK(hs.value_at(100)==1000);
+}
+
+TEST_CASE(pool_named_instances){
+    //two pools of the same type with their own arguments and sizes
+    auto& primary = connection_pool<pool_bench_db<7>>::instance("primary");
+    auto& analytics = connection_pool<pool_bench_db<7>>::instance("analytics");
+    TEST_CHECK(&primary!=&analytics);
+    TEST_CHECK(&primary==&connection_pool<pool_bench_db<7>>::instance("primary"));
+    primary.init(4, "127.0.0.1", "root", "12345", "testdb", 2);
+    analytics.init(1, std::string("127.0.0.2"), "root", "12345", "analytics", 2);
+    TEST_CHECK(primary.size()==4);
+    TEST_CHECK(analytics.size()==1);
+    {
+        auto conn = analytics.get();
+        conn_guard<pool_bench_db<7>> guard(conn, analytics);
+        TEST_CHECK(analytics.idle_size()==0);
+    }
+    TEST_CHECK(analytics.idle_size()==1);
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    connection_pool<dbng<sqlite>> pool;
+    TEST_CHECK(pool.init(2, "test.db").ok());
+    auto conn = pool.get();
+    TEST_REQUIRE(conn!=nullptr);
+    TEST_CHECK(conn->execute("DROP TABLE IF EXISTS person"));
+    pool.return_back(conn);
+#endif
+}
+
+TEST_CASE(rw_splitting){
+#ifdef ORMPP_ENABLE_SQLITE3
+    //two databases stand for the primary and the replica
+    connection_pool<dbng<sqlite>> primary;
+    connection_pool<dbng<sqlite>> replica;
+    TEST_REQUIRE(primary.init(2, "primary.db").ok());
+    TEST_REQUIRE(replica.init(2, "replica.db").ok());
+    for (auto pool : {&primary, &replica}) {
+        auto conn = pool->get();
+        TEST_REQUIRE(conn->execute("DROP TABLE IF EXISTS person"));
+        TEST_REQUIRE(conn->create_datatable<person>());
+        pool->return_back(conn);
+    }
+
+    rw_router<dbng<sqlite>> router(primary, {&replica}, std::chrono::milliseconds(200));
+    auto session = router.get_session();
+    TEST_CHECK(session.query<person>().empty());
+
+    //read your own writes in the pin window
+    TEST_CHECK(session.insert(person{1, "tom", 20})==1);
+    TEST_CHECK(session.query<person>().size()==1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    TEST_CHECK(session.query<person>().empty());
+
+    TEST_REQUIRE(session.begin());
+    TEST_CHECK(session.insert(person{2, "jack", 21})==1);
+    TEST_CHECK(session.query<person>().size()==2);
+    TEST_REQUIRE(session.rollback());
+    TEST_CHECK(session.query<person>().size()==1);
+    TEST_CHECK(router.replica_latencies().size()==1);
+#endif
+}
+
+//a connection which throws like dbng<mysql> does when the sql fails
+template<int N>
+struct throwing_db : pool_bench_db<N>{
+    template<typename T, typename... Args>
+    std::vector<T> query(Args&&...){ throw std::runtime_error("query error"); }
+    template<typename T>
+    int insert(const T&){ throw std::runtime_error("insert error"); }
+    bool rollback(){ return true; }
+};
+
+TEST_CASE(rw_router_exception){
+    connection_pool<throwing_db<0>> primary;
+    connection_pool<throwing_db<0>> replica;
+    TEST_REQUIRE(primary.init(1, ip, "root", "12345", "testdb", 2).ok());
+    TEST_REQUIRE(replica.init(1, ip, "root", "12345", "testdb", 2).ok());
+    rw_router<throwing_db<0>> router(primary, {&replica});
+    auto session = router.get_session();
+
+    //the connections are returned back even if they throw
+    int thrown = 0;
+    try{
+        session.query<person>();
+    }
+    catch(const std::exception&){
+        thrown++;
+    }
+    try{
+        session.insert(person{1, "tom", 20});
+    }
+    catch(const std::exception&){
+        thrown++;
+    }
+    TEST_CHECK(thrown==2);
+    TEST_CHECK(replica.idle_size()==1);
+    TEST_CHECK(primary.idle_size()==1);
+}
+
+TEST_CASE(sharded_query){
+#ifdef ORMPP_ENABLE_SQLITE3
+    //three sqlite files stand for three servers
+    connection_pool<dbng<sqlite>> pools[3];
+    std::string files[3] = {"shard0.db", "shard1.db", "shard2.db"};
+    for (int i = 0; i < 3; ++i) {
+        TEST_REQUIRE(pools[i].init(2, files[i].data()).ok());
+    }
+
+    sharded_dbng<sqlite> db({&pools[0], &pools[1], &pools[2]});
+    db.set_shard_key(FID(person::id));
+    TEST_REQUIRE(db.execute("DROP TABLE IF EXISTS person"));
+    TEST_REQUIRE(db.create_datatable<person>(ormpp_key{"id"}));
+
+    std::vector<person> v;
+    for (int i = 0; i < 30; ++i) {
+        v.push_back(person{i, "tom", i % 7});
+    }
+    TEST_CHECK(db.insert(v)==30);
+    TEST_CHECK(db.insert(person{30, "jack", 40})==1);
+    TEST_CHECK(db.query<person>().size()==31);
+
+    //routed to one shard by the shard key
+    auto r = db.query(FID(person::id), "=", 7);
+    TEST_REQUIRE(r.size()==1);
+    TEST_CHECK(r[0].id==7);
+
+    //merged by the order of age
+    auto ordered = db.query_ordered(FID(person::age), false, 5);
+    TEST_REQUIRE(ordered.size()==5);
+    TEST_CHECK(ordered[0].age==40);
+    for (size_t i = 1; i < ordered.size(); ++i) {
+        TEST_CHECK(ordered[i - 1].age>=ordered[i].age);
+    }
+
+    TEST_CHECK(db.delete_records(FID(person::id), "=", 30));
+    TEST_CHECK(db.query<person>().size()==30);
+
+    sharded_dbng<sqlite> ranged({&pools[0], &pools[1], &pools[2]}, sharded_dbng<sqlite>::range_map({10, 20}));
+    TEST_REQUIRE(ranged.delete_records<person>());
+    TEST_CHECK(ranged.insert(v)==30);
+    auto conn = pools[1].get();
+    TEST_CHECK(conn->query<person>().size()==10);
+    pools[1].return_back(conn);
+#endif
+}
+
+TEST_CASE(batch_loading){
+#ifdef ORMPP_ENABLE_SQLITE3
+    ormpp_key key{"id"};
+    {
+        dbng<sqlite> sqlite;
+        TEST_REQUIRE(sqlite.connect("loader.db"));
+        TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+        TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+        std::vector<simple> v;
+        for (int i = 0; i < 100; ++i) {
+            v.push_back(simple{i, i + 0.5, i * 2});
+        }
+        TEST_CHECK(sqlite.insert(v)==100);
+    }
+
+    connection_pool<dbng<sqlite>> pool;
+    TEST_REQUIRE(pool.init(2, "loader.db").ok());
+
+    batch_options options;
+    options.window = std::chrono::milliseconds(50);
+    batch_loader<dbng<sqlite>, simple, int> loader(pool, &simple::id, options);
+    auto f1 = loader.load(1);
+    auto f2 = loader.load(2);
+    auto f3 = loader.load(1);
+    auto f4 = loader.load(999);
+    TEST_CHECK(f1.get()->age==2);
+    TEST_CHECK(f2.get()->age==4);
+    TEST_CHECK(f3.get()->age==2);
+    TEST_CHECK(!f4.get().has_value());
+    auto stats = loader.stats();
+    TEST_CHECK(stats.loads==4);
+    TEST_CHECK(stats.coalesced==1);
+    TEST_CHECK(stats.batches==1);
+
+    std::atomic<int> wrong = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 32; ++i) {
+        threads.emplace_back([&loader, &wrong, i]{
+            auto row = loader.load(i % 16).get();
+            if(!row.has_value()||row->age!=i % 16 * 2)
+                wrong++;
+        });
+    }
+    for (auto& thd : threads) {
+        thd.join();
+    }
+    TEST_CHECK(wrong==0);
+    TEST_CHECK(loader.stats().batches<6);
+#endif
+}
+
+//a connection whose query takes a while, so the concurrent queries overlap
+template<int N>
+struct slow_query_db : pool_bench_db<N>{
+    template<typename T, typename... Args>
+    std::vector<T> query(Args&&...){
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return {T{}};
+    }
+};
+
+TEST_CASE(singleflight_query){
+    connection_pool<slow_query_db<0>> pool;
+    TEST_REQUIRE(pool.init(16, ip, "root", "12345", "testdb", 2).ok());
+    singleflight<slow_query_db<0>> sf(pool);
+
+    //checked here, the unit test isn't thread safe
+    std::atomic<int> wrong = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&sf, &wrong]{
+            if(sf.query<person>("id = 1").size()!=1)
+                wrong++;
+        });
+    }
+    for (auto& thd : threads) {
+        thd.join();
+    }
+    TEST_CHECK(wrong==0);
+    auto stats = sf.stats();
+    TEST_CHECK(stats.queries + stats.collapsed==8);
+    TEST_CHECK(stats.queries<8);
+
+    //a different condition or no_collapse isn't shared
+    auto f = std::async(std::launch::async, [&sf]{ return sf.query<person>("id = 1"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    TEST_CHECK(sf.query<person>("id = 2").size()==1);
+    TEST_CHECK(sf.query<person>(no_collapse, "id = 1").size()==1);
+    f.get();
+    TEST_CHECK(sf.stats().queries==stats.queries + 3);
+
+    //the floating point arguments are compared exactly
+    auto f1 = std::async(std::launch::async, [&sf]{ return sf.query<person>("age > ?", 1e-7); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    TEST_CHECK(sf.query<person>("age > ?", 2e-7).size()==1);
+    f1.get();
+    TEST_CHECK(sf.stats().queries==stats.queries + 5);
+}
+
+TEST_CASE(pool_contention_benchmark){
+    int threads = 64;
+    int times = 10000;
+
+    auto& pool = connection_pool<pool_bench_db<0>>::instance();
+    pool.init(16, ip, "root", "12345", "testdb", 2);
+    std::cout<<"one shard: "<<pool_contention(pool, threads, times)<<" ops/s"<<std::endl;
+
+    auto& pool1 = connection_pool<pool_bench_db<1>>::instance();
+    pool1.set_shards(0);
+    pool1.init(16, ip, "root", "12345", "testdb", 2);
+    std::cout<<"shard per core: "<<pool_contention(pool1, threads, times)<<" ops/s"<<std::endl;
+}
+
 TEST_CASE(orm_connect){
     int timeout = 5;
 
@@ -485,6 +913,410 @@ TEST_CASE(orm_multi_update){
 #endif
 }
 
+TEST_CASE(orm_update_by_key){
+    ormpp_key key{"id"};
+    std::vector<simple> v{{1, 2.5, 3}, {2, 3.5, 4}};
+    simple missing = {3, 4.5, 5};
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(mysql.create_datatable<simple>(key));
+    TEST_CHECK(mysql.insert(v)==2);
+    v[0].age = 30;
+    TEST_CHECK(mysql.update(v[0])==1);
+    TEST_CHECK(mysql.update(missing)==0);
+    TEST_CHECK(mysql.update(v)==2);
+    auto result = mysql.query<simple>("id = 1");
+    TEST_REQUIRE(result.size()==1);
+    TEST_CHECK(result[0].age==30);
+    TEST_CHECK(mysql.query<simple>().size()==2);
+    TEST_CHECK(mysql.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(v)==2);
+    v[0].age = 30;
+    TEST_CHECK(sqlite.update(v[0])==1);
+    TEST_CHECK(sqlite.update(missing)==0);
+    TEST_CHECK(sqlite.update(v)==2);
+    auto result1 = sqlite.query<simple>("id = 1");
+    TEST_REQUIRE(result1.size()==1);
+    TEST_CHECK(result1[0].age==30);
+    TEST_CHECK(sqlite.query<simple>().size()==2);
+    TEST_CHECK(sqlite.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(postgres.create_datatable<simple>(key));
+    TEST_CHECK(postgres.insert(v)==2);
+    v[0].age = 30;
+    TEST_CHECK(postgres.update(v[0])==1);
+    TEST_CHECK(postgres.update(missing)==0);
+    TEST_CHECK(postgres.update(v)==2);
+    auto result2 = postgres.query<simple>("id = 1");
+    TEST_REQUIRE(result2.size()==1);
+    TEST_CHECK(result2[0].age==30);
+    TEST_CHECK(postgres.query<simple>().size()==2);
+    TEST_CHECK(postgres.delete_records<simple>());
+#endif
+}
+
+TEST_CASE(orm_keys_per_database){
+#ifdef ORMPP_ENABLE_SQLITE3
+    //the same table has a key in one database and none in the other
+    dbng<sqlite> sqlite1;
+    dbng<sqlite> sqlite2;
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(ormpp_key{"id"}));
+    TEST_CHECK(sqlite.insert(simple{1, 2.5, 3})==1);
+    TEST_REQUIRE(sqlite1.connect("test1.db"));
+    TEST_REQUIRE(sqlite1.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite1.create_datatable<simple>());
+    TEST_CHECK(sqlite1.insert(simple{1, 2.5, 3})==1);
+
+    //another connection to the first database knows its key
+    TEST_REQUIRE(sqlite2.connect("test.db"));
+    TEST_CHECK(sqlite2.get<simple>(1).has_value());
+    TEST_CHECK(!sqlite1.get<simple>(1).has_value());
+    TEST_CHECK(sqlite.delete_records<simple>());
+    TEST_CHECK(sqlite1.execute("DROP TABLE IF EXISTS simple"));
+#endif
+}
+
+TEST_CASE(orm_get_by_key){
+    ormpp_key key{"id"};
+    std::vector<simple> v;
+    for (int i = 0; i < 600; ++i) {
+        v.push_back(simple{i, i + 0.5, i * 2});
+    }
+    std::vector<int> keys{3, 5, 7, 700};
+    std::vector<int> many_keys;
+    for (int i = 0; i < 600; i += 2) {
+        many_keys.push_back(i);
+    }
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(mysql.create_datatable<simple>(key));
+    TEST_CHECK(mysql.insert(v)==600);
+    auto row = mysql.get<simple>(5);
+    TEST_CHECK(row.has_value()&&row->age==10);
+    TEST_CHECK(!mysql.get<simple>(700).has_value());
+    TEST_CHECK(mysql.get_many<simple>(keys).size()==3);
+    TEST_CHECK(mysql.get_many<simple>(many_keys).size()==300);
+    TEST_CHECK(mysql.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(v)==600);
+    auto& cache = sqlite.get_statement_cache();
+    cache.reset_stats();
+    auto row1 = sqlite.get<simple>(5);
+    TEST_CHECK(row1.has_value()&&row1->age==10);
+    TEST_CHECK(!sqlite.get<simple>(700).has_value());
+    TEST_CHECK(sqlite.get_many<simple>(keys).size()==3);
+    TEST_CHECK(sqlite.get_many<simple>(many_keys).size()==300);
+    TEST_CHECK(sqlite.get_many<simple>(std::vector<int>{9, 11}).size()==2);
+    //the statements of 1, 8 and 512 keys are prepared once
+    TEST_CHECK(cache.stats().misses==3);
+    TEST_CHECK(sqlite.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(postgres.create_datatable<simple>(key));
+    TEST_CHECK(postgres.insert(v)==600);
+    auto row2 = postgres.get<simple>(5);
+    TEST_CHECK(row2.has_value()&&row2->age==10);
+    TEST_CHECK(!postgres.get<simple>(700).has_value());
+    TEST_CHECK(postgres.get_many<simple>(keys).size()==3);
+    TEST_CHECK(postgres.get_many<simple>(many_keys).size()==300);
+    TEST_CHECK(postgres.delete_records<simple>());
+#endif
+}
+
+TEST_CASE(orm_query_cache){
+#ifdef ORMPP_ENABLE_SQLITE3
+    ormpp_key key{"id"};
+    //two connections share the cache
+    dbng<sqlite> sqlite1;
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(std::vector<simple>{{1, 2.5, 3}, {2, 3.5, 4}})==2);
+
+    query_cache cache(2);
+    cache.set_ttl<simple>(std::chrono::seconds(60));
+    TEST_REQUIRE(sqlite1.connect("test.db"));
+    sqlite.set_query_cache(&cache);
+    sqlite1.set_query_cache(&cache);
+
+    TEST_CHECK(sqlite.query<simple>("id > 0").size()==2);
+    TEST_CHECK(sqlite1.query<simple>("id > 0").size()==2);
+    TEST_CHECK(cache.stats().hits==1);
+
+    //invalidated by the write of the other connection
+    TEST_CHECK(sqlite1.insert(simple{3, 4.5, 5})==1);
+    TEST_CHECK(sqlite.query<simple>("id > 0").size()==3);
+    TEST_CHECK(cache.stats().invalidations==1);
+
+    //the types without a ttl aren't cached
+    TEST_REQUIRE(sqlite.create_datatable<person>());
+    sqlite.query<person>();
+    TEST_CHECK(cache.stats().entries==1);
+
+    //the least recently used result is evicted
+    TEST_CHECK(sqlite.query<simple>("id = 1").size()==1);
+    TEST_CHECK(sqlite.query<simple>("id = 2").size()==1);
+    TEST_CHECK(cache.stats().evictions==1);
+    TEST_CHECK(cache.stats().entries==2);
+
+    //the results read in a transaction aren't cached, it may be rolled back
+    TEST_REQUIRE(sqlite.begin());
+    TEST_CHECK(sqlite.insert(simple{4, 5.5, 6})==1);
+    TEST_CHECK(sqlite.query<simple>("id > 1").size()==3);
+    TEST_CHECK(sqlite1.query<simple>("id > 1").size()==2);
+    TEST_REQUIRE(sqlite.rollback());
+    TEST_CHECK(sqlite.query<simple>("id > 1").size()==2);
+
+    TEST_CHECK(sqlite.delete_records<simple>());
+    TEST_CHECK(sqlite.query<simple>("id = 2").empty());
+#endif
+}
+
+//a database whose insert takes a while, so a query can run during it
+struct slow_write_db{
+    template<typename... Args>
+    bool connect(Args&&...){ return true; }
+    bool disconnect(){ return true; }
+
+    template<typename T, typename... Args>
+    std::vector<T> query(Args&&...){
+        std::unique_lock<std::mutex> lock(mtx);
+        return rows;
+    }
+
+    template<typename T>
+    int insert(const T& t){
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::unique_lock<std::mutex> lock(mtx);
+        rows.push_back(t);
+        return 1;
+    }
+
+    inline static std::mutex mtx;
+    inline static std::vector<simple> rows{{1, 2.5, 3}};
+};
+
+TEST_CASE(query_cache_write_race){
+    query_cache cache;
+    cache.set_ttl<simple>(std::chrono::seconds(60));
+    dbng<slow_write_db> reader;
+    dbng<slow_write_db> writer;
+    reader.set_query_cache(&cache);
+    writer.set_query_cache(&cache);
+
+    //the query during the insert reads and caches the old rows
+    auto f = std::async(std::launch::async, [&writer]{ return writer.insert(simple{2, 3.5, 4}); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    TEST_CHECK(reader.query<simple>().size()==1);
+    TEST_CHECK(f.get()==1);
+    //but they are invalidated after the insert
+    TEST_CHECK(reader.query<simple>().size()==2);
+}
+
+TEST_CASE(orm_entity_cache){
+#ifdef ORMPP_ENABLE_SQLITE3
+    ormpp_key key{"id"};
+    //two connections share the cache
+    dbng<sqlite> sqlite1;
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(std::vector<simple>{{1, 2.5, 3}, {2, 3.5, 4}, {3, 4.5, 5}})==3);
+
+    entity_cache cache(2, 4);
+    cache.add<simple>(&simple::id);
+    TEST_REQUIRE(sqlite1.connect("test.db"));
+    sqlite.set_entity_cache(&cache);
+    sqlite1.set_entity_cache(&cache);
+
+    TEST_CHECK(sqlite.get<simple>(1)->age==3);
+    TEST_CHECK(sqlite1.get<simple>(1)->age==3);
+    TEST_CHECK(sqlite1.get_many<simple>(std::vector<int>{1, 2, 4}).size()==2);
+    TEST_CHECK(cache.stats().hits==2);
+
+    //written through by the other connection
+    TEST_CHECK(sqlite1.update(simple{1, 2.5, 6})==1);
+    TEST_CHECK(sqlite.get<simple>(1)->age==6);
+    TEST_CHECK(cache.stats().hits==3);
+
+    //dropped by the other writes
+    TEST_CHECK(sqlite1.upsert(simple{2, 3.5, 7}, FID(simple::age))==1);
+    TEST_CHECK(sqlite.get<simple>(2)->age==7);
+    TEST_CHECK(sqlite1.delete_records<simple>("id = 1"));
+    TEST_CHECK(!sqlite.get<simple>(1).has_value());
+
+    //a rolled back update isn't written through
+    TEST_REQUIRE(sqlite1.begin());
+    TEST_CHECK(sqlite1.update(simple{2, 3.5, 8})==1);
+    //the rows read in the transaction aren't shared
+    TEST_CHECK(sqlite1.get<simple>(2)->age==8);
+    TEST_CHECK(sqlite.get<simple>(2)->age==7);
+    TEST_REQUIRE(sqlite1.rollback());
+    TEST_CHECK(sqlite.get<simple>(2)->age==7);
+
+    //the least recently used rows are evicted, at most one row in a shard
+    sqlite.get_many<simple>(std::vector<int>{2, 3});
+    TEST_CHECK(cache.stats().entries<=2);
+
+    TEST_CHECK(sqlite.delete_records<simple>());
+    TEST_CHECK(!sqlite.get<simple>(2).has_value());
+#endif
+}
+
+TEST_CASE(orm_update_tracked){
+    ormpp_key key{"id"};
+    simple s = {1, 2.5, 3};
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(mysql.create_datatable<simple>(key));
+    TEST_CHECK(mysql.insert(s)==1);
+    tracked<simple> t(mysql.query<simple>("id = 1")[0]);
+    //changed by another one, it isn't overwritten because code isn't changed here
+    TEST_REQUIRE(mysql.execute("update simple set code = 9.5 where id = 1"));
+    t->age = 30;
+    TEST_CHECK(t.dirty_mask()==4);
+    TEST_CHECK(mysql.update(t)==1);
+    TEST_CHECK(!t.dirty());
+    TEST_CHECK(mysql.update(t)==0);
+    auto result = mysql.query<simple>("id = 1");
+    TEST_REQUIRE(result.size()==1);
+    TEST_CHECK(result[0].code==9.5&&result[0].age==30);
+    TEST_CHECK(mysql.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(s)==1);
+    tracked<simple> t1(sqlite.query<simple>("id = 1")[0]);
+    TEST_REQUIRE(sqlite.execute("update simple set code = 9.5 where id = 1"));
+    t1->age = 30;
+    TEST_CHECK(t1.dirty_mask()==4);
+    TEST_CHECK(sqlite.update(t1)==1);
+    TEST_CHECK(!t1.dirty());
+    TEST_CHECK(sqlite.update(t1)==0);
+    auto result1 = sqlite.query<simple>("id = 1");
+    TEST_REQUIRE(result1.size()==1);
+    TEST_CHECK(result1[0].code==9.5&&result1[0].age==30);
+    //the row of a changed key is unknown, it stays changed
+    t1->id = 5;
+    t1->age = 31;
+    TEST_CHECK(sqlite.update(t1)==INT_MIN);
+    TEST_CHECK(t1.dirty());
+    TEST_CHECK(sqlite.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(postgres.create_datatable<simple>(key));
+    TEST_CHECK(postgres.insert(s)==1);
+    tracked<simple> t2(postgres.query<simple>("id = 1")[0]);
+    TEST_REQUIRE(postgres.execute("update simple set code = 9.5 where id = 1"));
+    t2->age = 30;
+    TEST_CHECK(t2.dirty_mask()==4);
+    TEST_CHECK(postgres.update(t2)==1);
+    TEST_CHECK(!t2.dirty());
+    TEST_CHECK(postgres.update(t2)==0);
+    auto result2 = postgres.query<simple>("id = 1");
+    TEST_REQUIRE(result2.size()==1);
+    TEST_CHECK(result2[0].code==9.5&&result2[0].age==30);
+    TEST_CHECK(postgres.delete_records<simple>());
+#endif
+}
+
+TEST_CASE(orm_upsert){
+    ormpp_key key{"id"};
+    std::vector<simple> v{{1, 2.5, 3}, {2, 3.5, 4}};
+    simple s1 = {1, 2.5, 30};
+    std::vector<simple> v1{{2, 9.5, 40}, {3, 4.5, 5}};
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(mysql.create_datatable<simple>(key));
+    TEST_CHECK(mysql.insert(v)==2);
+    //mysql counts an updated row twice
+    TEST_CHECK(mysql.upsert(s1)==2);
+    TEST_CHECK(mysql.upsert(v1, FID(simple::age))==3);
+    auto result = mysql.query<simple>("id > 0 order by id");
+    TEST_REQUIRE(result.size()==3);
+    TEST_CHECK(result[0].age==30);
+    TEST_CHECK(result[1].code==3.5&&result[1].age==40);
+    TEST_CHECK(mysql.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    TEST_CHECK(sqlite.insert(v)==2);
+    TEST_CHECK(sqlite.upsert(s1)==1);
+    TEST_CHECK(sqlite.upsert(v1, FID(simple::age))==2);
+    auto result1 = sqlite.query<simple>("id > 0 order by id");
+    TEST_REQUIRE(result1.size()==3);
+    TEST_CHECK(result1[0].age==30);
+    TEST_CHECK(result1[1].code==3.5&&result1[1].age==40);
+    TEST_CHECK(sqlite.delete_records<simple>());
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(postgres.create_datatable<simple>(key));
+    TEST_CHECK(postgres.insert(v)==2);
+    TEST_CHECK(postgres.upsert(s1)==1);
+    TEST_CHECK(postgres.upsert(v1, FID(simple::age))==2);
+    auto result2 = postgres.query<simple>("id > 0 order by id");
+    TEST_REQUIRE(result2.size()==3);
+    TEST_CHECK(result2[0].age==30);
+    TEST_CHECK(result2[1].code==3.5&&result2[1].age==40);
+    TEST_CHECK(postgres.delete_records<simple>());
+#endif
+}
+
 TEST_CASE(orm_delete){
     ormpp_key key{"code"};
     ormpp_not_null not_null{{"code", "age"}};
@@ -573,6 +1405,192 @@ TEST_CASE(orm_query){
 #endif
 }
 
+TEST_CASE(orm_statement_cache){
+    ormpp_key key{"id"};
+    simple s1 = {1, 2.5, 3};
+    simple s2 = {2, 3.5, 4};
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(mysql.create_datatable<simple>(key));
+    auto& cache = mysql.get_statement_cache();
+    cache.reset_stats();
+    TEST_CHECK(mysql.insert(s1)==1);
+    TEST_CHECK(mysql.insert(s2)==1);
+    TEST_CHECK(mysql.query<simple>().size()==2);
+    TEST_CHECK(mysql.query<simple>().size()==2);
+    TEST_CHECK(cache.stats().misses==2);
+    TEST_CHECK(cache.stats().hits==2);
+    cache.set_capacity(1);
+    TEST_CHECK(cache.stats().evictions==1);
+    TEST_REQUIRE(mysql.disconnect());
+    TEST_CHECK(cache.size()==0);
+#endif
+
+#ifdef ORMPP_ENABLE_SQLITE3
+    dbng<sqlite> sqlite;
+    TEST_REQUIRE(sqlite.connect("test.db"));
+    TEST_REQUIRE(sqlite.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(sqlite.create_datatable<simple>(key));
+    auto& cache1 = sqlite.get_statement_cache();
+    cache1.reset_stats();
+    TEST_CHECK(sqlite.insert(s1)==1);
+    TEST_CHECK(sqlite.insert(s2)==1);
+    TEST_CHECK(sqlite.query<simple>().size()==2);
+    TEST_CHECK(sqlite.query<simple>().size()==2);
+    TEST_CHECK(cache1.stats().misses==2);
+    TEST_CHECK(cache1.stats().hits==2);
+    cache1.set_capacity(1);
+    TEST_CHECK(cache1.stats().evictions==1);
+    TEST_REQUIRE(sqlite.disconnect());
+    TEST_CHECK(cache1.size()==0);
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS simple"));
+    TEST_REQUIRE(postgres.create_datatable<simple>(key));
+    auto& cache2 = postgres.get_statement_cache();
+    cache2.reset_stats();
+    TEST_CHECK(postgres.insert(s1)==1);
+    TEST_CHECK(postgres.insert(s2)==1);
+    //the queries with inlined values are sent unnamed, they aren't cached
+    TEST_CHECK(postgres.query<simple>().size()==2);
+    TEST_CHECK(postgres.query<simple>("id = 1").size()==1);
+    TEST_CHECK(cache2.size()==1);
+    TEST_CHECK(postgres.get<simple>(1)->id==1);
+    TEST_CHECK(postgres.get<simple>(2)->id==2);
+    TEST_CHECK(cache2.stats().misses==2);
+    TEST_CHECK(cache2.stats().hits==2);
+    cache2.set_capacity(1);
+    TEST_CHECK(cache2.stats().evictions==1);
+    TEST_REQUIRE(postgres.disconnect());
+    TEST_CHECK(cache2.size()==0);
+#endif
+}
+
+TEST_CASE(orm_batch_insert){
+    ormpp_key key{"code"};
+    std::vector<student> v;
+    for (int i = 0; i < 20000; ++i) {
+        v.push_back(student{i, "tom", 0, i, 1.5, "classroom1"});
+    }
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS student"));
+    TEST_REQUIRE(mysql.create_datatable<student>(key));
+    TEST_CHECK(mysql.insert(v)==20000);
+    TEST_CHECK(mysql.query<student>().size()==20000);
+#endif
+}
+
+TEST_CASE(orm_query_stream){
+    ormpp_key key{"code"};
+    std::vector<student> v;
+    for (int i = 0; i < 1000; ++i) {
+        v.push_back(student{i, "tom", 0, i, 1.5, "classroom1"});
+    }
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS student"));
+    TEST_REQUIRE(mysql.create_datatable<student>(key));
+    TEST_CHECK(mysql.insert(v)==1000);
+
+    int sum = 0;
+    TEST_CHECK(mysql.query_stream<student>([&sum](student& s){ sum += s.age; })==1000);
+    TEST_CHECK(sum==999*1000/2);
+
+    //stop at the 10th row, the connection is still usable
+    TEST_CHECK(mysql.query_stream<student>([](student& s){ return s.code<9; }, "code >= 0 order by code")==10);
+    TEST_CHECK(mysql.query<student>().size()==1000);
+#endif
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS student"));
+    TEST_REQUIRE(postgres.create_datatable<student>(key));
+    TEST_CHECK(postgres.insert(v)==1000);
+
+    int sum1 = 0;
+    TEST_CHECK(postgres.query_stream<student>([&sum1](student& s){ sum1 += s.age; })==1000);
+    TEST_CHECK(sum1==999*1000/2);
+
+    TEST_CHECK(postgres.query_stream<student>([](student& s){ return s.code<9; }, "code >= 0 order by code")==10);
+    TEST_CHECK(postgres.query<student>().size()==1000);
+
+    //the error is reported after all the results are read, the connection is still usable
+    TEST_CHECK(postgres.query_stream<student>([](student&){}, "no_such_column > 0")==-1);
+    TEST_CHECK(postgres.query<student>().size()==1000);
+#endif
+}
+
+TEST_CASE(orm_string_fetch){
+    ormpp_key key{"id"};
+    person p1 = {1, std::string(1000, 'a'), 20};
+    person p2 = {2, "", 30};
+
+#ifdef ORMPP_ENABLE_MYSQL
+    dbng<mysql> mysql;
+    TEST_REQUIRE(mysql.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(mysql.execute("DROP TABLE IF EXISTS person"));
+    TEST_REQUIRE(mysql.create_datatable<person>(key));
+    TEST_CHECK(mysql.insert(p1)==1);
+    TEST_CHECK(mysql.insert(p2)==1);
+    auto v = mysql.query<person>("id > 0 order by id");
+    TEST_REQUIRE(v.size()==2);
+    TEST_CHECK(v[0].name==p1.name);
+    TEST_CHECK(v[1].name.empty());
+    TEST_CHECK(mysql.get_refetch_count()==0);
+#endif
+}
+
+TEST_CASE(orm_copy_insert){
+    ormpp_key key{"code"};
+    std::vector<student> v;
+    for (int i = 0; i < 20000; ++i) {
+        v.push_back(student{i, "tom", 0, i, 1.5, "classroom1"});
+    }
+
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS student"));
+    TEST_REQUIRE(postgres.create_datatable<student>(key));
+    TEST_CHECK(postgres.insert(v)==20000);
+    TEST_CHECK(postgres.query<student>().size()==20000);
+#endif
+}
+
+//the columns of the table are created as bigint
+struct narrow_total{
+    int id;
+    int total;
+};
+REFLECTION(narrow_total, id, total)
+
+TEST_CASE(orm_param_width){
+#ifdef ORMPP_ENABLE_PG
+    dbng<postgresql> postgres;
+    TEST_REQUIRE(postgres.connect(ip, "root", "12345", "testdb"));
+    TEST_REQUIRE(postgres.execute("DROP TABLE IF EXISTS narrow_total"));
+    TEST_REQUIRE(postgres.execute("CREATE TABLE narrow_total(id bigint primary key, total bigint)"));
+    TEST_CHECK(postgres.insert(narrow_total{1, 5})==1);
+    TEST_CHECK(postgres.insert(std::vector<narrow_total>{{2, 6}, {3, 7}})==2);
+    auto v = postgres.query<narrow_total>("id > 1 order by id");
+    TEST_REQUIRE(v.size()==2);
+    TEST_CHECK(v[0].total==6);
+    TEST_CHECK(v[1].total==7);
+#endif
+}
+
 TEST_CASE(orm_query_some){
     ormpp_key key{"code"};
     ormpp_not_null not_null{{"code", "age"}};
@@ -0,0 +1,105 @@
+#ifndef ORMPP_MPMC_QUEUE_HPP
+#define ORMPP_MPMC_QUEUE_HPP
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+namespace ormpp{
+    //bounded lock-free multi-producer multi-consumer queue, every cell has a sequence number
+    //which tells the producers and consumers whether it is free or filled (Dmitry Vyukov's queue).
+    template<typename T>
+    class mpmc_queue{
+    public:
+        explicit mpmc_queue(size_t capacity){
+            size_t size = 2;
+            while(size<capacity){
+                size <<= 1;
+            }
+
+            cells_.reset(new cell[size]);
+            mask_ = size - 1;
+            for (size_t i = 0; i < size; ++i) {
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        mpmc_queue(const mpmc_queue&) = delete;
+        mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+        bool try_push(T&& value){
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            cell* c;
+            for(;;){
+                c = &cells_[pos & mask_];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+                if(diff==0){
+                    if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff<0){
+                    //full
+                    return false;
+                }
+                else{
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            c->data = std::move(value);
+            c->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& value){
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            cell* c;
+            for(;;){
+                c = &cells_[pos & mask_];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+                if(diff==0){
+                    if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff<0){
+                    //empty
+                    return false;
+                }
+                else{
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            value = std::move(c->data);
+            c->data = T{};
+            c->seq.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+        }
+
+        //not exact while other threads are pushing or popping
+        size_t size() const{
+            size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+            size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+            return tail>head ? tail - head : 0;
+        }
+
+        size_t capacity() const{
+            return mask_ + 1;
+        }
+
+    private:
+        struct cell{
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        std::unique_ptr<cell[]> cells_;
+        size_t mask_ = 0;
+        alignas(64) std::atomic<size_t> enqueue_pos_{0};
+        alignas(64) std::atomic<size_t> dequeue_pos_{0};
+    };
+}
+
+#endif //ORMPP_MPMC_QUEUE_HPP
@@ -5,6 +5,7 @@
 #ifndef ORM_MYSQL_HPP
 #define ORM_MYSQL_HPP
 #include <string_view>
+#include <algorithm>
 #include <utility>
 #include <climits>
 #include <map>
@@ -13,6 +14,7 @@
 #include "type_mapping.hpp"
 #include "utility.hpp"
 #include "mysql_exception.h"
+#include "statement_cache.hpp"
 
 namespace ormpp
 {
@@ -37,6 +39,7 @@ namespace ormpp
 				disconnect();
 			}
 
+			max_allowed_packet_ = 0;
 			con_ = mysql_init(nullptr);
 			if (con_ == nullptr)
 			{
@@ -44,7 +47,8 @@ namespace ormpp
 			}
 
 			int timeout = -1;
-			auto tp = std::tuple_cat(get_tp(timeout, std::forward<Args>(args)...), std::make_tuple(0, nullptr, 0));
+			//CLIENT_FOUND_ROWS: the affected rows of an update are the matched rows, not the changed ones
+			auto tp = std::tuple_cat(get_tp(timeout, std::forward<Args>(args)...), std::make_tuple(0, nullptr, CLIENT_FOUND_ROWS));
 
 			if (timeout > 0)
 			{
@@ -68,6 +72,15 @@ namespace ormpp
 			{
 				throw  mysql_exception(con_);
 			}
+
+			thread_id_ = mysql_thread_id(con_);
+			auto str = [](const auto& s) {
+				if constexpr (std::is_pointer_v<std::decay_t<decltype(s)>>)
+					return std::string(s == nullptr ? "" : s);
+				else
+					return std::string(s);
+			};
+			keys_ = get_table_keys("mysql:" + str(std::get<1>(tp)) + "/" + str(std::get<4>(tp)));
 		}
 
 
@@ -80,6 +93,8 @@ namespace ormpp
 		bool disconnect(Args&&... args)
 		{
 			if (con_ != nullptr) {
+				//the cached statements must be closed before the connection
+				stmt_cache_.clear();
 				mysql_close(con_);
 				con_ = nullptr;
 			}
@@ -92,6 +107,46 @@ namespace ormpp
 			return mysql_affected_rows(con_);
 		}
 
+		//the server side max_allowed_packet, queried once per connection
+		uint64_t get_max_allowed_packet()
+		{
+			if (max_allowed_packet_ != 0)
+				return max_allowed_packet_;
+
+			const std::string sql = "SELECT @@max_allowed_packet";
+			if (mysql_real_query(con_, sql.data(), (unsigned long)sql.size()) != 0)
+			{
+				throw mysql_exception(con_);
+			}
+
+			auto res = mysql_store_result(con_);
+			if (res == nullptr)
+			{
+				throw mysql_exception(con_);
+			}
+
+			auto row = mysql_fetch_row(res);
+			max_allowed_packet_ = (row != nullptr && row[0] != nullptr) ? std::strtoull(row[0], nullptr, 10) : 0;
+			mysql_free_result(res);
+			if (max_allowed_packet_ == 0)
+			{
+				max_allowed_packet_ = default_max_allowed_packet;
+			}
+
+			return max_allowed_packet_;
+		}
+
+		statement_cache<mysql_prepared_statement>& get_statement_cache()
+		{
+			return stmt_cache_;
+		}
+
+		//how many string columns were fetched twice because the buffer was too small
+		uint64_t get_refetch_count() const
+		{
+			return refetch_count_;
+		}
+
 		uint64_t exec_commmand(const std::string& sql)
 		{
 			if (mysql_real_query(con_, sql.data(), sql.size()) != 0)
@@ -105,7 +160,8 @@ namespace ormpp
 		template <typename... Args>
 		uint64_t exec_commmand(const std::string& sql, Args&&... args)
 		{
-			mysql_prepared_statement statement(con_, sql);
+			auto stmt = prepare_statement(sql);
+			auto& statement = *stmt;
 
 			if (0 != statement.get_field_count())
 			{
@@ -132,7 +188,8 @@ namespace ormpp
 		template <typename... InputArgs, typename... OutputArgs>
 		uint64_t exec_query(std::vector<std::tuple<OutputArgs...>>& results, const std::string& query, InputArgs&&... args) const
 		{
-			mysql_prepared_statement statement(con_, query);
+			auto stmt = prepare_statement(query);
+			auto& statement = *stmt;
 
 			if (0 == statement.get_field_count())
 			{
@@ -161,6 +218,7 @@ namespace ormpp
 			{
 				results.push_back(tp);
 			}
+			refetch_count_ += result_set.get_refetch_count();
 
 			return statement.affected_rows();
 		}
@@ -487,13 +545,17 @@ namespace ormpp
 		template<typename T, typename... Args>
 		constexpr uint64_t insert(const std::vector<T>& t, Args&&... args) {
 			auto name = get_name<T>();
-			std::string sql = auto_key_map_[name].empty() ? generate_insert_sql<T>(false) : generate_auto_insert_sql<T>(auto_key_map_, false);
+			std::string sql = auto_key_map()[name].empty() ? generate_insert_sql<T>(false) : generate_auto_insert_sql<T>(auto_key_map(), false);
 
 			return insert_impl(sql, t, std::forward<Args>(args)...);
 		}
 
 		template<typename T, typename... Args>
 		constexpr uint64_t update(const std::vector<T>& t, Args&&... args) {
+			auto index = key_index<T>();
+			if (index < iguana::get_value<T>())
+				return update_impl(generate_update_sql<T>(get_name<T>(), index), t, index);
+
 			std::string sql = generate_insert_sql<T>(true);
 
 			return insert_impl(sql, t, std::forward<Args>(args)...);
@@ -503,17 +565,84 @@ namespace ormpp
 		constexpr uint64_t insert(const T& t, Args&&... args) {
 			//insert into person values(?, ?, ?);
 			auto name = get_name<T>();
-			std::string sql = auto_key_map_[name].empty() ? generate_insert_sql<T>(false) : generate_auto_insert_sql<T>(auto_key_map_, false);
+			std::string sql = auto_key_map()[name].empty() ? generate_insert_sql<T>(false) : generate_auto_insert_sql<T>(auto_key_map(), false);
 
 			return insert_impl(sql, t, std::forward<Args>(args)...);
 		}
 
+		//update t set ... where key=? if the table has a key, otherwise the row is replaced
 		template<typename T, typename... Args>
 		constexpr uint64_t update(const T& t, Args&&... args) {
+			auto index = key_index<T>();
+			if (index < iguana::get_value<T>())
+				return update_impl(generate_update_sql<T>(get_name<T>(), index), t, index);
+
 			std::string sql = generate_insert_sql<T>(true);
 			return insert_impl(sql, t, std::forward<Args>(args)...);
 		}
 
+		//update only the fields in the mask by the key, a bit for every field in the order of the fields.
+		//the tables without a key are updated as a whole. throws if the key is in the mask, the row to
+		//update would be unknown.
+		template<typename T>
+		uint64_t update_fields(const T& t, uint64_t mask) {
+			auto index = key_index<T>();
+			if (index >= iguana::get_value<T>())
+				return update(t);
+
+			if (mask & (uint64_t(1) << index))
+				throw mysql_exception(std::string("the key of ") + get_name<T>() + " is changed");
+
+			if (mask == 0)
+				return 0;
+
+			auto stmt = prepare_statement(generate_update_fields_sql<T>(get_name<T>(), index, mask));
+			auto& statement = *stmt;
+			unsigned short pos = 0;
+			iguana::for_each(t,
+				[&statement, &t, &pos, mask](auto& ele, auto I)
+				{
+					if (mask & (uint64_t(1) << decltype(I)::value))
+						statement.set_index_param_bind(pos++, t.*ele);
+				}
+			);
+			iguana::for_each(t,
+				[&statement, &t, pos, index](auto& ele, auto I)
+				{
+					if (decltype(I)::value == index)
+						statement.set_index_param_bind(pos, t.*ele);
+				}
+			);
+
+			statement.execute();
+			return statement.affected_rows();
+		}
+
+		//insert into t values(...) on duplicate key update ..., the key or any unique index decides
+		//whether the row is updated. returns the affected rows of mysql: 1 for an inserted row and 2
+		//for an updated row.
+		template<typename T>
+		uint64_t upsert(const T& t, const std::vector<std::string_view>& fields) {
+			constexpr auto SIZE = iguana::get_value<T>();
+			auto stmt = prepare_statement(generate_batch_sql(generate_insert_sql<T>(false), SIZE, 1) + generate_upsert_suffix<T>(fields));
+			auto& statement = *stmt;
+			iguana::for_each(t,
+				[&statement, &t](auto& ele, auto I)
+				{
+					statement.set_index_param_bind(I, t.*ele);
+				}
+			);
+
+			statement.execute();
+			return statement.affected_rows();
+		}
+
+		//the rows are upserted by the multi-row statements of insert(vector)
+		template<typename T>
+		uint64_t upsert(const std::vector<T>& v, const std::vector<std::string_view>& fields) {
+			return insert_rows(generate_insert_sql<T>(false), v, generate_upsert_suffix<T>(fields));
+		}
+
 		template<typename T, typename... Args>
 		constexpr bool delete_records(Args&&... where_conditon) {
 			auto sql = generate_delete_sql<T>(std::forward<Args>(where_conditon)...);
@@ -544,7 +673,8 @@ namespace ormpp
 			constexpr auto SIZE = iguana::get_value<T>();
 
 
-			mysql_prepared_statement statement(con_, sql);
+			auto stmt = prepare_statement(sql);
+			auto& statement = *stmt;
 
 			if (0 == statement.get_field_count())
 			{
@@ -577,9 +707,93 @@ namespace ormpp
 			{
 				v.push_back(t);
 			}
+			refetch_count_ += result_set.get_refetch_count();
+			return v;
+		}
+
+		//the rows of the keys by the key of the table, the rows are in no particular order and the
+		//missing keys are skipped. see get_key_batch_size for the size of the statements.
+		template<typename T, typename K>
+		std::vector<T> get_many(const std::vector<K>& keys)
+		{
+			auto it = key_map().find(get_name<T>());
+			if (it == key_map().end() || it->second.empty())
+				throw mysql_exception(get_name<T>() + " has no key");
+
+			std::vector<T> v;
+			size_t begin = 0;
+			while (begin < keys.size())
+			{
+				const size_t count = get_key_batch_size(keys.size() - begin);
+				const size_t end = (std::min)(keys.size(), begin + count);
+				auto stmt = prepare_statement(generate_get_sql<T>(get_name<T>(), it->second, count));
+				auto& statement = *stmt;
+				for (size_t i = 0; i < count; i++)
+				{
+					statement.set_index_param_bind((unsigned short)i, keys[(std::min)(begin + i, end - 1)]);
+				}
+
+				auto result_set = statement.execute_query();
+				T t{};
+				result_set.bind_result_by_object(t);
+				while (result_set.fetch())
+				{
+					v.push_back(t);
+				}
+				refetch_count_ += result_set.get_refetch_count();
+				begin = end;
+			}
+
 			return v;
 		}
 
+		//visit the rows one by one without storing the result on the client, the same T is reused
+		//for every row, so the memory doesn't grow with the rows. if f returns false, stop visiting.
+		//the connection can't be used by f, the rest rows are discarded when the visiting stops.
+		template<typename T, typename F, typename... Args>
+		std::enable_if_t<iguana::is_reflection_v<T>, int64_t> query_stream(F&& f, Args&&... args)
+		{
+			std::string sql = generate_query_sql<T>(args...);
+
+			//the streaming statement isn't cached, the cursor type is set on it
+			auto stmt = prepare_statement(sql, false);
+			auto& statement = *stmt;
+
+			if (0 == statement.get_field_count())
+			{
+				throw mysql_exception("Tried to run execute with execute_query");
+			}
+
+			statement.set_param_bind();
+			auto result_set = statement.execute_stream(prefetch_rows_);
+
+			int64_t count = 0;
+			T t{};
+			result_set.bind_result_by_object(t);
+			while (result_set.fetch())
+			{
+				count++;
+				if constexpr (std::is_same_v<bool, std::invoke_result_t<F, T&>>)
+				{
+					if (!f(t))
+						break;
+				}
+				else
+				{
+					f(t);
+				}
+			}
+			refetch_count_ += result_set.get_refetch_count();
+			return count;
+		}
+
+		//0 means the rows are read from the connection directly, otherwise a read-only server
+		//cursor is opened and the rows are fetched prefetch_rows at a time.
+		void set_stream_prefetch_rows(unsigned long prefetch_rows)
+		{
+			prefetch_rows_ = prefetch_rows;
+		}
+
 
 	private:
 		template<typename T, typename... Args >
@@ -589,7 +803,8 @@ namespace ormpp
 			std::string sql = std::string("CREATE TABLE IF NOT EXISTS ") + name.data() + "(";
 			auto arr = iguana::get_array<T>();
 			constexpr auto SIZE = sizeof... (Args);
-			auto_key_map_[name.data()] = "";
+			auto_key_map()[name.data()] = "";
+			key_map()[name.data()] = "";
 
 			//auto_increment_key and key can't exist at the same time
 			using U = std::tuple<std::decay_t <Args>...>;
@@ -624,6 +839,7 @@ namespace ormpp
 							append(sql, field_name.data(), " ", type_name_arr[i]);
 						}
 						append(sql, " PRIMARY KEY");
+						key_map()[name.data()] = item.fields;
 						has_add_field = true;
 					}
 					else if constexpr (std::is_same_v<decltype(item), ormpp_auto_key>) {
@@ -632,7 +848,8 @@ namespace ormpp
 						}
 						append(sql, " AUTO_INCREMENT");
 						append(sql, " PRIMARY KEY");
-						auto_key_map_[name.data()] = item.fields;
+						auto_key_map()[name.data()] = item.fields;
+						key_map()[name.data()] = item.fields;
 						has_add_field = true;
 					}
 					else if constexpr (std::is_same_v<decltype(item), ormpp_unique>) {
@@ -723,7 +940,8 @@ namespace ormpp
 		constexpr uint64_t insert_impl(const std::string& sql, const T& object, Args&&... args)
 		{
 			static_assert(iguana::is_reflection_v<T>, "type must be reflection");
-			mysql_prepared_statement statement(con_, sql);
+			auto stmt = prepare_statement(sql);
+			auto& statement = *stmt;
 			iguana::for_each(object,
 				[&statement, &object](auto& ele, auto I)
 				{
@@ -738,33 +956,201 @@ namespace ormpp
 			return statement.affected_rows();
 		}
 
+		template<typename T>
+		std::string generate_upsert_suffix(const std::vector<std::string_view>& fields) const
+		{
+			auto it = key_map().find(get_name<T>());
+			std::string_view key = it == key_map().end() ? std::string_view() : std::string_view(it->second);
+			std::string suffix = " on duplicate key update ";
+			bool first = true;
+			for (auto field : get_upsert_fields<T>(key, fields))
+			{
+				if (!first)
+					suffix += ", ";
+				first = false;
+				suffix += std::string(field) + "=values(" + std::string(field) + ")";
+			}
+
+			return suffix;
+		}
+
+		//the index of the key field, or the number of the fields if the table has no key
+		template<typename T>
+		size_t key_index() const
+		{
+			auto it = key_map().find(get_name<T>());
+			if (it == key_map().end() || it->second.empty())
+				return iguana::get_value<T>();
+
+			return get_field_index<T>(it->second);
+		}
+
+		//the fields are bound in the order of the set clause and the key is the last one
+		template<typename T>
+		void bind_update_params(mysql_prepared_statement& statement, const T& object, size_t key_index)
+		{
+			constexpr auto SIZE = iguana::get_value<T>();
+			iguana::for_each(object,
+				[&statement, &object, key_index](auto& ele, auto I)
+				{
+					size_t i = I;
+					statement.set_index_param_bind((unsigned short)(i == key_index ? SIZE - 1 : (i < key_index ? i : i - 1)), object.*ele);
+				}
+			);
+		}
+
+		template<typename T>
+		uint64_t update_impl(const std::string& sql, const T& object, size_t key_index)
+		{
+			auto stmt = prepare_statement(sql);
+			bind_update_params(*stmt, object, key_index);
+			stmt->execute();
+			return stmt->affected_rows();
+		}
+
+		//one prepared statement is executed for every row
+		template<typename T>
+		uint64_t update_impl(const std::string& sql, const std::vector<T>& v_object, size_t key_index)
+		{
+			auto stmt = prepare_statement(sql);
+			uint64_t count = 0;
+			for (auto& object : v_object)
+			{
+				bind_update_params(*stmt, object, key_index);
+				stmt->execute();
+				count += stmt->affected_rows();
+			}
+
+			return count;
+		}
+
+		//the rows are sent by multi-row statements: insert into t(a,b) values(?,?),(?,?)...
+		//a chunk is limited by the 65535 placeholders of a statement and max_allowed_packet,
+		//the statement of a full chunk is the same every time, so it is cached and reused.
 		template<typename T, typename... Args>
 		constexpr uint64_t insert_impl(const std::string& sql, const std::vector<T>& v_object, Args&&... args)
 		{
+			return insert_rows(sql, v_object, "");
+		}
 
+		//suffix is appended to the values of every chunk, such as on duplicate key update ...
+		template<typename T>
+		uint64_t insert_rows(const std::string& sql, const std::vector<T>& v_object, const std::string& suffix)
+		{
 			static_assert(iguana::is_reflection_v<T>, "type must be reflection");
-			mysql_prepared_statement statement(con_, sql);
+			if (v_object.empty())
+				return 0;
+
+			constexpr auto SIZE = iguana::get_value<T>();
+			const size_t max_rows = max_placeholders / SIZE;
+			const uint64_t max_allowed_packet = get_max_allowed_packet();
+			const uint64_t max_bytes = max_allowed_packet > packet_reserved_size ? max_allowed_packet - packet_reserved_size : max_allowed_packet;
 
 			uint64_t count = 0;
-			for (auto& object : v_object)
+			size_t begin = 0;
+			while (begin < v_object.size())
 			{
+				size_t end = begin;
+				uint64_t bytes = 0;
+				while (end < v_object.size() && end - begin < max_rows)
+				{
+					auto row_bytes = get_param_size(v_object[end]);
+					if (end > begin && bytes + row_bytes > max_bytes)
+						break;
+
+					bytes += row_bytes;
+					end++;
+				}
+
+				count += insert_chunk(sql, v_object, begin, end, end - begin == max_rows, suffix);
+				begin = end;
+			}
+
+			return count;
+		}
+
+		template<typename T>
+		uint64_t insert_chunk(const std::string& sql, const std::vector<T>& v_object, size_t begin, size_t end, bool cached, const std::string& suffix)
+		{
+			constexpr auto SIZE = iguana::get_value<T>();
+			auto stmt = prepare_statement(generate_batch_sql(sql, SIZE, end - begin) + suffix, cached);
+			auto& statement = *stmt;
+
+			for (size_t row = begin; row < end; row++)
+			{
+				auto& object = v_object[row];
+				const size_t offset = (row - begin) * SIZE;
 				iguana::for_each(object,
-					[&statement, &object](auto& ele, auto I)
+					[&statement, &object, offset](auto& ele, auto I)
 					{
-						using U = std::remove_reference_t<decltype(object.*ele)>;
-						statement.set_index_param_bind(I, object.*ele);
-
+						statement.set_index_param_bind((unsigned short)(offset + I), object.*ele);
 					}
 				);
+			}
+
+			statement.execute();
+			return statement.affected_rows();
+		}
+
+		//repeat the values(...) of a single row insert sql for rows
+		static std::string generate_batch_sql(const std::string& sql, size_t fields, size_t rows)
+		{
+			std::string batch_sql = sql;
+			while (!batch_sql.empty() && (batch_sql.back() == ' ' || batch_sql.back() == ';'))
+			{
+				batch_sql.pop_back();
+			}
 
-				statement.execute();
-				count += statement.affected_rows();
+			std::string values = ",(";
+			for (size_t i = 0; i < fields; ++i)
+			{
+				values += "?";
+				if (i < fields - 1)
+					values += ", ";
 			}
+			values += ")";
 
-			return  count;
+			batch_sql.reserve(batch_sql.size() + values.size() * rows);
+			for (size_t i = 1; i < rows; ++i)
+			{
+				batch_sql += values;
+			}
 
+			return batch_sql;
 		}
 
+		//the size of a row in the COM_STMT_EXECUTE packet, 2 bytes type info and at most 9 bytes length per param
+		template<typename T>
+		static uint64_t get_param_size(const T& object)
+		{
+			uint64_t size = 0;
+			iguana::for_each(object,
+				[&size, &object](auto& ele, auto)
+				{
+					using U = std::remove_const_t<std::remove_reference_t<decltype(object.*ele)>>;
+					if constexpr (std::is_arithmetic_v<U>)
+					{
+						size += 2 + sizeof(U);
+					}
+					else if constexpr (std::is_same_v<std::string, U>)
+					{
+						size += 2 + 9 + (object.*ele).size();
+					}
+					else
+					{
+						size += 2 + 9 + sizeof(U);
+					}
+				}
+			);
+
+			return size;
+		}
+
+		//reuse the statement prepared on this connection, the cache is dropped when the
+		//client has reconnected by itself(MYSQL_OPT_RECONNECT), the old handles are invalid then.
+		//the statements used only once(such as the last chunk of a batch insert) shouldn't be cached.
+		std::shared_ptr<mysql_prepared_statement> prepare_statement(const std::string& sql, bool cached = true) const;
+
 		template<typename... Args>
 		auto get_tp(int& timeout, Args&&... args)
 		{
@@ -780,8 +1166,28 @@ namespace ormpp
 		}
 
 	private:
+		std::map<std::string, std::string>& auto_key_map() const
+		{
+			return keys_->auto_key_map;
+		}
+
+		std::map<std::string, std::string>& key_map() const
+		{
+			return keys_->key_map;
+		}
+
+		static constexpr size_t max_placeholders = 65535;
+		static constexpr uint64_t default_max_allowed_packet = 4 * 1024 * 1024;
+		static constexpr uint64_t packet_reserved_size = 1024;
+
 		MYSQL* con_ = nullptr;
-		inline static std::map<std::string, std::string> auto_key_map_;
+		uint64_t max_allowed_packet_ = 0;
+		mutable unsigned long thread_id_ = 0;
+		mutable uint64_t refetch_count_ = 0;
+		unsigned long prefetch_rows_ = 0;
+		mutable statement_cache<mysql_prepared_statement> stmt_cache_;
+		//shared by the connections to the same database, so the ones which didn't create the tables know their keys
+		std::shared_ptr<table_keys> keys_ = std::make_shared<table_keys>();
 	};
 
 	class mysql_result_set
@@ -807,6 +1213,12 @@ namespace ormpp
 			return field_count_;
 		}
 
+		//how many times a string column was truncated and fetched again
+		uint64_t get_refetch_count() const
+		{
+			return refetch_count_;
+		}
+
 		template<typename T, typename...ARGS >
 		void bind_result_by_args(T& arg1, ARGS&... args)
 		{
@@ -831,6 +1243,7 @@ namespace ormpp
 				out_parameters_.resize(field_count_, {});
 				out_lengths_.resize(field_count_, 0);
 				out_null_flags_.resize(field_count_);
+				str_buffers_.resize(field_count_);
 			}
 
 			var_info_.clear();
@@ -870,6 +1283,7 @@ namespace ormpp
 				out_parameters_.resize(field_count_, {});
 				out_lengths_.resize(field_count_, 0);
 				out_null_flags_.resize(field_count_);
+				str_buffers_.resize(field_count_);
 			}
 
 
@@ -893,37 +1307,46 @@ namespace ormpp
 			auto fetch_status = mysql_stmt_fetch(stmt_.get());
 			if (fetch_status == 0 || fetch_status == MYSQL_DATA_TRUNCATED)
 			{
-
-				if (fetch_status == MYSQL_DATA_TRUNCATED)
+				bool rebind = false;
+				for (auto& info : var_info_)
 				{
-					MYSQL_BIND bind = {};
-
-					for (auto& info : var_info_)
+					auto index = info.index;
+					auto& str = *info.p_str;
+					if (out_null_flags_[index])
 					{
-						auto index = info.index;
-						auto& str = *info.p_str;
+						str.clear();
+						continue;
+					}
 
-						if (!out_null_flags_[index])
+					auto& buf = str_buffers_[index];
+					const size_t untruncated_length = out_lengths_[index];
+					if (untruncated_length > buf.size())
+					{
+						//grow the buffer, so the next rows are not truncated again
+						buf.resize((std::max)(untruncated_length, buf.size() * 2));
+						out_parameters_[index].buffer = buf.data();
+						out_parameters_[index].buffer_length = static_cast<unsigned long>(buf.size());
+						rebind = true;
+						refetch_count_++;
+
+						const int status = mysql_stmt_fetch_column(
+							stmt_.get(),
+							&out_parameters_[index],
+							static_cast<unsigned int>(index),
+							0);
+
+						if (0 != status)
 						{
-							const size_t untruncated_length = out_lengths_[index];
-							str.resize(untruncated_length);
-
-							bind.buffer = str.data();
-							bind.buffer_length = str.size();
-
-							const int status = mysql_stmt_fetch_column(
-								stmt_.get(),
-								&bind,
-								index,
-								0);
-
-							if (0 != status)
-							{
-								throw mysql_exception(stmt_.get());
-							}
-
+							throw mysql_exception(stmt_.get());
 						}
 					}
+
+					str.assign(buf.data(), untruncated_length);
+				}
+
+				if (rebind && mysql_stmt_bind_result(stmt_.get(), &out_parameters_[0]))
+				{
+					throw mysql_exception(stmt_.get());
 				}
 
 				return true;
@@ -951,6 +1374,22 @@ namespace ormpp
 	private:
 
 
+		//the max length of every column is known after mysql_stmt_store_result,
+		//the string buffers are sized by it, so the rows needn't be fetched twice.
+		void set_max_lengths()
+		{
+			auto* meta = mysql_stmt_result_metadata(stmt_.get());
+			if (meta == nullptr)
+				return;
+
+			max_lengths_.resize(field_count_, 0);
+			for (unsigned int i = 0; i < field_count_; i++)
+			{
+				max_lengths_[i] = mysql_fetch_field_direct(meta, i)->max_length;
+			}
+			mysql_free_result(meta);
+		}
+
 		template<typename T, typename...ARGS>
 		void bind_result_by_args_impl(size_t index, T& value, ARGS&... args)
 		{
@@ -981,10 +1420,16 @@ namespace ormpp
 			}
 			else if constexpr (std::is_same_v<std::string, U>)
 			{
-				static char s_placeholder;
+				auto& buf = str_buffers_[I];
+				if (buf.empty())
+				{
+					size_t max_length = I < max_lengths_.size() ? max_lengths_[I] : 0;
+					buf.resize(max_length > 0 ? max_length : default_string_capacity);
+				}
+
 				out_parameters_[I].buffer_type = MYSQL_TYPE_VAR_STRING;
-				out_parameters_[I].buffer = &s_placeholder;
-				out_parameters_[I].buffer_length = sizeof(s_placeholder);
+				out_parameters_[I].buffer = buf.data();
+				out_parameters_[I].buffer_length = static_cast<unsigned long>(buf.size());
 				out_parameters_[I].length = &out_lengths_[I];
 				out_parameters_[I].is_null = reinterpret_cast<bool*>(&out_null_flags_[I]);
 
@@ -1022,6 +1467,12 @@ namespace ormpp
 		};
 		std::vector<VariableFieldsInfo> var_info_;
 		size_t reflection_field_count_=0;
+
+		//used when the max length is unknown, the buffer grows when a value is truncated
+		static constexpr size_t default_string_capacity = 64;
+		std::vector<std::vector<char>> str_buffers_;
+		std::vector<unsigned long> max_lengths_;
+		uint64_t refetch_count_ = 0;
 	private:
 		std::shared_ptr<MYSQL_STMT> stmt_ = nullptr;
 		unsigned long field_count_ = 0;
@@ -1082,6 +1533,12 @@ namespace ormpp
 			parameter_count_ = mysql_stmt_param_count(stmt);
 			field_count_ = mysql_stmt_field_count(stmt);
 
+			if (field_count_ > 0)
+			{
+				//let mysql_stmt_store_result compute the max length of every column
+				bool update_max_length = true;
+				mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+			}
 
 		}
 	public:
@@ -1184,10 +1641,33 @@ namespace ormpp
 			}
 
 			mysql_result_set result(stmt_, get_field_count());
+			result.set_max_lengths();
 
 			return result;
 		}
 
+		//the result isn't stored, the rows are read by mysql_result_set::fetch one by one
+		mysql_result_set execute_stream(unsigned long prefetch_rows = 0)
+		{
+			if (prefetch_rows > 0)
+			{
+				unsigned long cursor_type = CURSOR_TYPE_READ_ONLY;
+				if (mysql_stmt_attr_set(stmt_.get(), STMT_ATTR_CURSOR_TYPE, &cursor_type) ||
+					mysql_stmt_attr_set(stmt_.get(), STMT_ATTR_PREFETCH_ROWS, &prefetch_rows))
+				{
+					throw mysql_exception(stmt_.get());
+				}
+			}
+
+			bind_param();
+			if (mysql_stmt_execute(stmt_.get()))
+			{
+				throw mysql_exception(stmt_.get());
+			}
+
+			return mysql_result_set(stmt_, get_field_count());
+		}
+
 		uint64_t affected_rows()
 		{
 			return mysql_stmt_affected_rows(stmt_.get());
@@ -1229,6 +1709,26 @@ namespace ormpp
 		std::vector<MYSQL_BIND> param_binds_;
 	};
 
+	inline std::shared_ptr<mysql_prepared_statement> mysql::prepare_statement(const std::string& sql, bool cached) const
+	{
+		if (!cached)
+		{
+			return std::shared_ptr<mysql_prepared_statement>(new mysql_prepared_statement(con_, sql));
+		}
+
+		auto thread_id = mysql_thread_id(con_);
+		if (thread_id != thread_id_)
+		{
+			stmt_cache_.clear();
+			thread_id_ = thread_id;
+		}
+
+		return stmt_cache_.get_or_prepare(sql, [this](const std::string& s)
+			{
+				return std::shared_ptr<mysql_prepared_statement>(new mysql_prepared_statement(con_, s));
+			});
+	}
+
 }
 
 
@@ -0,0 +1,161 @@
+#ifndef ORMPP_POOL_METRICS_HPP
+#define ORMPP_POOL_METRICS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ormpp{
+    //log-linear buckets like HdrHistogram: the values less than sub_buckets are exact, the others
+    //are split into sub_buckets buckets per power of two, so the error is less than 1/sub_buckets.
+    struct histogram_snapshot{
+        static constexpr size_t sub_bits = 3;
+        static constexpr size_t sub_buckets = 1 << sub_bits;
+        static constexpr size_t bucket_num = sub_buckets + (64 - sub_bits) * sub_buckets;
+
+        std::array<uint64_t, bucket_num> buckets = {};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        static size_t bucket_index(uint64_t v){
+            if(v<sub_buckets)
+                return (size_t)v;
+
+            size_t exp = 63;
+            while((v>>exp)==0){
+                exp--;
+            }
+            size_t sub = (size_t)(v>>(exp - sub_bits)) & (sub_buckets - 1);
+            return sub_buckets + (exp - sub_bits) * sub_buckets + sub;
+        }
+
+        //the upper bound of the values in the bucket
+        static uint64_t bucket_value(size_t index){
+            if(index<sub_buckets)
+                return index;
+
+            size_t exp = (index - sub_buckets) / sub_buckets + sub_bits;
+            uint64_t sub = (index - sub_buckets) % sub_buckets;
+            uint64_t low = (uint64_t(1)<<exp) + (sub<<(exp - sub_bits));
+            return low + (uint64_t(1)<<(exp - sub_bits)) - 1;
+        }
+
+        //percentile is in [0, 100]
+        uint64_t value_at(double percentile) const{
+            if(count==0)
+                return 0;
+
+            auto target = (uint64_t)(percentile / 100 * count + 0.5);
+            if(target==0)
+                target = 1;
+
+            uint64_t n = 0;
+            for (size_t i = 0; i < bucket_num; ++i) {
+                n += buckets[i];
+                if(n>=target)
+                    return (std::min)(bucket_value(i), max);
+            }
+
+            return max;
+        }
+
+        double mean() const{
+            return count==0 ? 0 : (double)sum / count;
+        }
+    };
+
+    //recording is a few relaxed atomic increments, it is only summed up when it is read
+    class latency_histogram{
+    public:
+        void record(uint64_t v){
+            buckets_[histogram_snapshot::bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(v, std::memory_order_relaxed);
+            uint64_t max = max_.load(std::memory_order_relaxed);
+            while(v>max&&!max_.compare_exchange_weak(max, v, std::memory_order_relaxed)){
+            }
+        }
+
+        histogram_snapshot snapshot() const{
+            histogram_snapshot s;
+            for (size_t i = 0; i < histogram_snapshot::bucket_num; ++i) {
+                s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+                s.count += s.buckets[i];
+            }
+            s.sum = sum_.load(std::memory_order_relaxed);
+            s.max = max_.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, histogram_snapshot::bucket_num> buckets_ = {};
+        std::atomic<uint64_t> sum_{0};
+        std::atomic<uint64_t> max_{0};
+    };
+
+    struct pool_stats{
+        //pool size
+        size_t size = 0;
+        size_t idle = 0;
+        size_t in_use = 0;
+        int waiters = 0;
+
+        uint64_t acquires = 0;
+        uint64_t timeouts = 0;
+        uint64_t created = 0;
+        uint64_t create_failures = 0;
+        //the connections replaced because they were too old or failed to ping
+        uint64_t reconnects = 0;
+        //the connections returned broken
+        uint64_t broken = 0;
+        //the idle connections closed down to min_idle
+        uint64_t trimmed = 0;
+        uint64_t pings = 0;
+        uint64_t ping_failures = 0;
+
+        //in microseconds
+        histogram_snapshot acquire_wait;
+        histogram_snapshot hold_time;
+    };
+
+    struct pool_metrics{
+        std::atomic<uint64_t> acquires{0};
+        std::atomic<uint64_t> timeouts{0};
+        std::atomic<uint64_t> created{0};
+        std::atomic<uint64_t> create_failures{0};
+        std::atomic<uint64_t> reconnects{0};
+        std::atomic<uint64_t> broken{0};
+        std::atomic<uint64_t> trimmed{0};
+        std::atomic<uint64_t> pings{0};
+        std::atomic<uint64_t> ping_failures{0};
+        latency_histogram acquire_wait;
+        latency_histogram hold_time;
+
+        static void add(std::atomic<uint64_t>& counter){
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static uint64_t micros_since(std::chrono::steady_clock::time_point begin){
+            return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin).count();
+        }
+
+        void fill(pool_stats& s) const{
+            s.acquires = acquires.load(std::memory_order_relaxed);
+            s.timeouts = timeouts.load(std::memory_order_relaxed);
+            s.created = created.load(std::memory_order_relaxed);
+            s.create_failures = create_failures.load(std::memory_order_relaxed);
+            s.reconnects = reconnects.load(std::memory_order_relaxed);
+            s.broken = broken.load(std::memory_order_relaxed);
+            s.trimmed = trimmed.load(std::memory_order_relaxed);
+            s.pings = pings.load(std::memory_order_relaxed);
+            s.ping_failures = ping_failures.load(std::memory_order_relaxed);
+            s.acquire_wait = acquire_wait.snapshot();
+            s.hold_time = hold_time.snapshot();
+        }
+    };
+}
+
+#endif //ORMPP_POOL_METRICS_HPP
@@ -6,7 +6,12 @@
 #define ORM_POSTGRESQL_HPP
 
 #include <string>
+#include <array>
+#include <algorithm>
+#include <cstring>
 #include <type_traits>
+#include "utility.hpp"
+#include "statement_cache.hpp"
 #ifdef _MSC_VER
 #include <include/libpq-fe.h>
 #else
@@ -16,6 +21,71 @@
 using namespace std::string_literals;
 
 namespace ormpp{
+    //the size of a field in the binary parameter buffer, bool is sent as an integer and char as
+    //the text of the number(at most "-128"), strings are not copied.
+    template<typename U>
+    inline constexpr size_t pg_fixed_param_size(){
+        if constexpr(std::is_same_v<U, bool>||std::is_same_v<U, char>)
+            return 4;
+        else if constexpr(std::is_arithmetic_v<U>)
+            return sizeof(U);
+        else
+            return 0;
+    }
+
+    //the type of a binary parameter is given to the server, so the value is converted to the type of the
+    //column, such as an int field to a bigint column. bool is sent as an integer, the type of char and
+    //the strings is left to the server, their binary format is the text.
+    template<typename U>
+    inline constexpr Oid pg_param_type(){
+        if constexpr(std::is_same_v<U, bool>)
+            return (Oid)ormpp_postgresql::type_to_id(identity<int>{});
+        else if constexpr(std::is_same_v<U, char>||!std::is_arithmetic_v<U>||sizeof(U)==1||sizeof(U)>8)
+            return 0;
+        else if constexpr(std::is_floating_point_v<U>)
+            return (Oid)ormpp_postgresql::type_to_id(identity<std::conditional_t<sizeof(U)==4, float, double>>{});
+        else
+            return (Oid)ormpp_postgresql::type_to_id(identity<std::conditional_t<sizeof(U)==2, short, std::conditional_t<sizeof(U)==4, int, int64_t>>>{});
+    }
+
+    template<typename T, size_t... Idx>
+    inline constexpr auto pg_param_types(std::index_sequence<Idx...>){
+        return std::array<Oid, sizeof...(Idx)>{pg_param_type<std::remove_cv_t<std::remove_reference_t<decltype(iguana::get<Idx>(std::declval<T>()))>>>()...};
+    }
+
+    template<typename T, size_t... Idx>
+    inline constexpr auto pg_param_offsets(std::index_sequence<Idx...>){
+        constexpr size_t sizes[] = {pg_fixed_param_size<std::remove_cv_t<std::remove_reference_t<decltype(iguana::get<Idx>(std::declval<T>()))>>>()..., 0};
+        std::array<size_t, sizeof...(Idx) + 1> offsets = {};
+        for (size_t i = 0; i < sizeof...(Idx); ++i) {
+            offsets[i + 1] = offsets[i] + sizes[i];
+        }
+        return offsets;
+    }
+
+    //the binary parameters of T, the layout is computed at compile time from the reflection,
+    //it is reused for every row so that there is no allocation for a row.
+    template<typename T>
+    struct pg_params{
+        static constexpr size_t SIZE = iguana::get_value<T>();
+        static constexpr auto offsets = pg_param_offsets<T>(std::make_index_sequence<SIZE>{});
+        static constexpr auto types = pg_param_types<T>(std::make_index_sequence<SIZE>{});
+
+        pg_params(){
+            formats.fill(1);
+        }
+
+        std::array<char, offsets[SIZE] == 0 ? 1 : offsets[SIZE]> data = {};
+        std::array<const char*, SIZE> values = {};
+        std::array<int, SIZE> lengths = {};
+        std::array<int, SIZE> formats = {};
+    };
+
+    struct pg_statement{
+        std::string name;
+        int result_format = 0;
+    };
+
     class postgresql{
     public:
         ~postgresql(){
@@ -27,13 +97,16 @@ namespace ormpp{
         bool connect(Args&&... args){
             auto sql = ""s;
 			sql = generate_conn_sql(std::make_tuple(std::forward<Args>(args)...));
-  
+
+            disconnect();
             con_ = PQconnectdb(sql.data());
             if (PQstatus(con_) != CONNECTION_OK){
                 std::cout<<PQerrorMessage(con_)<<std::endl;
                 return false;
             }
 
+            auto str = [](const char* s){ return std::string(s==nullptr ? "" : s); };
+            keys_ = get_table_keys("postgresql:" + str(PQhost(con_)) + ":" + str(PQport(con_)) + "/" + str(PQdb(con_)));
             return true;
         }
 
@@ -44,9 +117,15 @@ namespace ormpp{
                 con_ = nullptr;
             }
 
+            //the server has dropped the named statements with the session
+            stmt_cache_.clear();
             return true;
         }
 
+        statement_cache<pg_statement>& get_statement_cache(){
+            return stmt_cache_;
+        }
+
 		bool ping() {
 			return (PQstatus(con_) == CONNECTION_OK);
 		}
@@ -84,25 +163,34 @@ namespace ormpp{
         constexpr int insert(const T& t,Args&&... args){
 //            std::string sql = generate_pq_insert_sql<T>(false);
             std::string sql = generate_auto_insert_sql<T>(false);
-            if(!prepare<T>(sql))
+            auto stmt = prepare_statement(sql, (int)iguana::get_value<T>(), pg_params<T>::types.data(), false);
+            if(stmt==nullptr)
                 return INT_MIN;
 
-            return insert_impl(sql, t, std::forward<Args>(args)...);
+            pg_params<T> params;
+            return insert_impl(stmt->name, t, params);
         }
 
         template<typename T, typename... Args>
         constexpr int insert(const std::vector<T>& v,Args&&... args){
+            if(copy_threshold_>0&&v.size()>=copy_threshold_)
+                return copy_insert(v);
+
 //            std::string sql = generate_pq_insert_sql<T>(false);
             std::string sql = generate_auto_insert_sql<T>(false);
 
             if(!begin())
                 return INT_MIN;
 
-            if(!prepare<T>(sql))
+            auto stmt = prepare_statement(sql, (int)iguana::get_value<T>(), pg_params<T>::types.data(), false);
+            if(stmt==nullptr){
+                rollback();
                 return INT_MIN;
+            }
 
+            pg_params<T> params;
             for(auto& item : v){
-                auto result = insert_impl(sql, item, std::forward<Args>(args)...);
+                auto result = insert_impl(stmt->name, item, params);
                 if(result==INT_MIN){
                     rollback();
                     return INT_MIN;
@@ -115,13 +203,186 @@ namespace ormpp{
             return (int)v.size();
         }
 
+        //bulk load by COPY ... FROM STDIN in binary format, the data is sent to the server
+        //every flush_size bytes, return the number of rows or INT_MIN if failed.
+        template<typename T>
+        int copy_insert(const std::vector<T>& v, size_t flush_size = 0){
+            static_assert(iguana::is_reflection_v<T>, "type must be reflection");
+            if(flush_size==0)
+                flush_size = copy_flush_size_;
+
+            std::string sql = generate_copy_sql<T>();
+            res_ = PQexec(con_, sql.data());
+            if (PQresultStatus(res_) != PGRES_COPY_IN){
+                std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                PQclear(res_);
+                return INT_MIN;
+            }
+            PQclear(res_);
+
+            //signature, flags field and header extension length
+            static const char header[] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0";
+            std::string buf;
+            buf.reserve(flush_size + 1024);
+            buf.append(header, sizeof(header)-1);
+
+            constexpr auto SIZE = iguana::get_value<T>();
+            bool ok = true;
+            for(auto& t : v){
+                append_network(buf, (int16_t)SIZE);
+                iguana::for_each(t, [&t, &buf](auto item, auto){
+                    auto& value = t.*item;
+                    auto len = binary_length(value);
+                    append_network(buf, (int32_t)len);
+                    auto pos = buf.size();
+                    buf.resize(pos + len);
+                    to_binary(&buf[pos], value);
+                });
+
+                if(buf.size()>=flush_size){
+                    if(PQputCopyData(con_, buf.data(), (int)buf.size())!=1){
+                        ok = false;
+                        break;
+                    }
+                    buf.clear();
+                }
+            }
+
+            //file trailer
+            append_network(buf, (int16_t)-1);
+            if(ok&&PQputCopyData(con_, buf.data(), (int)buf.size())!=1)
+                ok = false;
+
+            if(PQputCopyEnd(con_, ok? nullptr : "ormpp copy_insert aborted")!=1)
+                ok = false;
+
+            while((res_ = PQgetResult(con_))!=nullptr){
+                if (PQresultStatus(res_) != PGRES_COMMAND_OK){
+                    std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                    ok = false;
+                }
+                PQclear(res_);
+            }
+
+            return ok ? (int)v.size() : INT_MIN;
+        }
+
+        //insert(vector) switches to copy_insert when there are at least threshold rows, 0 means never
+        void set_copy_options(size_t threshold, size_t flush_size){
+            copy_threshold_ = threshold;
+            copy_flush_size_ = flush_size;
+        }
+
+        //update only the fields in the mask by the key, a bit for every field in the order of the fields.
+        //the tables without a key are updated as a whole. fails if the key is in the mask, the row to
+        //update would be unknown.
+        template<typename T>
+        int update_fields(const T& t, uint64_t mask){
+            auto index = key_index<T>();
+            if(index>=iguana::get_value<T>())
+                return update(t);
+
+            if(mask&(uint64_t(1)<<index)){
+                std::cout<<"the key of "<<iguana::get_name<T>()<<" is changed"<<std::endl;
+                return INT_MIN;
+            }
+
+            if(mask==0)
+                return 0;
+
+            //all the fields are encoded, then the ones in the mask and the key are sent
+            pg_params<T> params;
+            set_param_values(params, t);
+            std::vector<const char*> values;
+            std::vector<int> lengths;
+            std::vector<int> formats;
+            std::vector<Oid> types;
+            for (size_t i = 0; i <= pg_params<T>::SIZE; ++i) {
+                size_t field = i<pg_params<T>::SIZE ? i : index;
+                if(i<pg_params<T>::SIZE&&(mask&(uint64_t(1)<<i))==0)
+                    continue;
+
+                values.push_back(params.values[field]);
+                lengths.push_back(params.lengths[field]);
+                formats.push_back(params.formats[field]);
+                types.push_back(pg_params<T>::types[field]);
+            }
+
+            auto stmt = prepare_statement(generate_update_fields_sql<T>(iguana::get_name<T>(), index, mask, "$"), (int)values.size(), types.data(), false);
+            if(stmt==nullptr)
+                return INT_MIN;
+
+            res_ = PQexecPrepared(con_, stmt->name.data(), (int)values.size(), values.data(), lengths.data(), formats.data(), 0);
+            if (PQresultStatus(res_) != PGRES_COMMAND_OK){
+                std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                PQclear(res_);
+                return INT_MIN;
+            }
+
+            int rows = std::atoi(PQcmdTuples(res_));
+            PQclear(res_);
+            return rows;
+        }
+
+        //insert ... on conflict(key) do update set ..., the table must have a key.
+        //returns the number of the inserted or updated rows.
+        template<typename T>
+        int upsert(const T& t, const std::vector<std::string_view>& fields){
+            auto sql = generate_upsert_sql<T>(1, fields);
+            if(sql.empty())
+                return INT_MIN;
+
+            auto stmt = prepare_statement(sql, (int)iguana::get_value<T>(), pg_params<T>::types.data(), false);
+            if(stmt==nullptr)
+                return INT_MIN;
+
+            pg_params<T> params;
+            return insert_impl(stmt->name, t, params);
+        }
+
+        //the rows are sent by multi-row statements in a transaction, the statement of a full chunk
+        //is prepared once. a key must not be repeated in a chunk, postgresql can't update a row twice.
+        template<typename T>
+        int upsert(const std::vector<T>& v, const std::vector<std::string_view>& fields){
+            constexpr auto SIZE = iguana::get_value<T>();
+            const size_t max_rows = max_params / SIZE;
+            if(!begin())
+                return INT_MIN;
+
+            int rows = 0;
+            for (size_t i = 0; i < v.size(); i += max_rows) {
+                auto result = upsert_chunk(v, i, (std::min)(v.size(), i + max_rows), fields);
+                if(result==INT_MIN){
+                    rollback();
+                    return INT_MIN;
+                }
+                rows += result;
+            }
+
+            if(!commit())
+                return INT_MIN;
+
+            return rows;
+        }
+
+        //update t set ... where key=$n if the table has a key, returns the number of the updated rows.
         //if there is no key in a table, you can set some fields as a condition in the args...
         template<typename T, typename... Args>
         constexpr int update(const T& t, Args&&... args) {
+            auto index = key_index<T>();
+            if(index<iguana::get_value<T>()){
+                auto stmt = prepare_statement(generate_update_sql<T>(iguana::get_name<T>(), index, "$"), (int)iguana::get_value<T>(), pg_params<T>::types.data(), false);
+                if(stmt==nullptr)
+                    return INT_MIN;
+
+                pg_params<T> params;
+                return insert_impl(stmt->name, t, params);
+            }
+
             //transaction, firstly delete, secondly insert
             auto name = iguana::get_name<T>();
-            auto it = key_map_.find(name.data());
-            auto key = it==key_map_.end()?"":it->second;
+            auto it = key_map().find(name.data());
+            auto key = it==key_map().end()?"":it->second;
 
             auto condition = get_condition(t, key, std::forward<Args...>(args)...);
             if(!begin())
@@ -145,13 +406,17 @@ namespace ormpp{
 
         template<typename T, typename... Args>
         constexpr int update(const std::vector<T>& v, Args&&... args){
+            auto index = key_index<T>();
+            if(index<iguana::get_value<T>())
+                return update_by_key(v, index);
+
             //transaction, firstly delete, secondly insert
             if(!begin())
                 return INT_MIN;
 
             auto name = iguana::get_name<T>();
-            auto it = key_map_.find(name.data());
-            auto key = it==key_map_.end()?"":it->second;
+            auto it = key_map().find(name.data());
+            auto key = it==key_map().end()?"":it->second;
             for(auto& t: v){
                 auto condition = get_condition(t, key, std::forward<Args...>(args)...);
 
@@ -177,14 +442,8 @@ namespace ormpp{
             std::string sql = generate_query_sql<T>(std::forward<Args>(args)...);
             constexpr auto SIZE = iguana::get_value<T>();
 
-            if(!prepare<T>(sql))
-                return {};
-
-            res_ = PQexec(con_, sql.data());
-            if (PQresultStatus(res_) != PGRES_TUPLES_OK){
-                PQclear(res_);
+            if(!exec_query(sql))
                 return {};
-            }
 
             std::vector<T> v;
             auto ntuples = PQntuples(res_);
@@ -203,6 +462,143 @@ namespace ormpp{
             return v;
         }
 
+        //the rows of the keys by the key of the table, the rows are in no particular order and the
+        //missing keys are skipped. see get_key_batch_size for the size of the statements.
+        template<typename T, typename K>
+        std::vector<T> get_many(const std::vector<K>& keys){
+            auto index = key_index<T>();
+            if(index>=iguana::get_value<T>()){
+                std::cout<<iguana::get_name<T>()<<" has no key"<<std::endl;
+                return {};
+            }
+
+            std::vector<T> v;
+            size_t begin = 0;
+            while(begin<keys.size()){
+                const size_t count = get_key_batch_size(keys.size() - begin);
+                const size_t end = (std::min)(keys.size(), begin + count);
+                auto sql = generate_get_sql<T>(iguana::get_name<T>(), iguana::get_name<T>(index), count, "$");
+                std::vector<Oid> types(count, pg_params<T>::types[index]);
+                auto stmt = prepare_statement(sql, (int)count, types.data(), true);
+                if(stmt==nullptr)
+                    return {};
+
+                //the keys are encoded as the key field of a row, so they have the type of the column
+                std::vector<T> probes(end - begin);
+                std::vector<pg_params<T>> params(end - begin);
+                std::vector<const char*> values(count);
+                std::vector<int> lengths(count);
+                std::vector<int> formats(count);
+                for (size_t i = 0; i < count; ++i) {
+                    size_t j = (std::min)(begin + i, end - 1) - begin;
+                    if(i<probes.size()){
+                        set_key(probes[j], index, keys[begin + j]);
+                        set_param_values(params[j], probes[j]);
+                    }
+                    values[i] = params[j].values[index];
+                    lengths[i] = params[j].lengths[index];
+                    formats[i] = params[j].formats[index];
+                }
+
+                res_ = PQexecPrepared(con_, stmt->name.data(), (int)count, values.data(), lengths.data(), formats.data(), stmt->result_format);
+                if (PQresultStatus(res_) != PGRES_TUPLES_OK){
+                    std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                    PQclear(res_);
+                    stmt_cache_.erase(sql);
+                    return {};
+                }
+
+                auto ntuples = PQntuples(res_);
+                for(auto i = 0; i < ntuples; i++){
+                    T t = {};
+                    iguana::for_each(t, [this, i, &t](auto item, auto I)
+                    {
+                        assign(t.*item, i, (int)decltype(I)::value);
+                    });
+                    v.push_back(std::move(t));
+                }
+                PQclear(res_);
+                begin = end;
+            }
+
+            return v;
+        }
+
+        //visit the rows one by one in single row mode, only one row is held on the client and the
+        //same T is reused for every row. if f returns false, the rest of the query is canceled.
+        //the sql is sent unnamed like exec_query, if the first row can't be decoded from binary,
+        //the query is canceled and sent again in text format before any row is visited.
+        //returns the count of the visited rows, or -1 if the query failed.
+        template<typename T, typename F, typename... Args>
+        std::enable_if_t<iguana::is_reflection_v<T>, int64_t> query_stream(F&& f, Args&&... args){
+            std::string sql = generate_query_sql<T>(std::forward<Args>(args)...);
+            int64_t count = 0;
+            for(int format = 1; format>=0; format--){
+                if(!PQsendQueryParams(con_, sql.data(), 0, nullptr, nullptr, nullptr, nullptr, format)){
+                    std::cout<<PQerrorMessage(con_)<<std::endl;
+                    return -1;
+                }
+
+                //the query is canceled and its results are read if f throws, the connection is usable again
+                res_ = nullptr;
+                guard_stream guard(*this);
+                //or else the whole result would be buffered
+                if(!PQsetSingleRowMode(con_)){
+                    std::cout<<"failed to set single row mode"<<std::endl;
+                    return -1;
+                }
+
+                bool canceled = false;
+                bool failed = false;
+                bool text = false;
+                T t = {};
+                //all the results must be read, then the connection can be used again
+                while((res_ = PQgetResult(con_))!=nullptr){
+                    auto status = PQresultStatus(res_);
+                    if(status==PGRES_SINGLE_TUPLE&&!canceled&&format==1&&count==0&&!is_binary_supported(res_)){
+                        text = true;
+                        canceled = true;
+                        cancel();
+                    }
+                    else if(status==PGRES_SINGLE_TUPLE&&!canceled){
+                        iguana::for_each(t, [this, &t](auto item, auto I)
+                        {
+                            assign(t.*item, 0, (int)decltype(I)::value);
+                        });
+                        count++;
+
+                        bool go_on = true;
+                        if constexpr(std::is_same_v<bool, std::invoke_result_t<F, T&>>){
+                            go_on = f(t);
+                        }
+                        else{
+                            f(t);
+                        }
+
+                        if(!go_on){
+                            canceled = true;
+                            cancel();
+                        }
+                    }
+                    else if(status!=PGRES_SINGLE_TUPLE&&status!=PGRES_TUPLES_OK&&!canceled){
+                        std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                        failed = true;
+                    }
+                    PQclear(res_);
+                }
+                guard.dismiss();
+
+                //the results are all read, so the connection is usable even if the query failed
+                if(failed)
+                    return -1;
+
+                if(!text)
+                    break;
+            }
+
+            return count;
+        }
+
         template<typename T, typename Arg, typename... Args>
         constexpr std::enable_if_t<!iguana::is_reflection_v<T>, std::vector<T>> query(const Arg& s, Args&&... args){
             static_assert(iguana::is_tuple<T>::value);
@@ -217,14 +613,8 @@ namespace ormpp{
                 sql = get_sql(sql, std::forward<Args>(args)...);
             }
 
-            if(!prepare<T>(sql))
-                return {};
-
-            res_ = PQexec(con_, sql.data());
-            if (PQresultStatus(res_) != PGRES_TUPLES_OK){
-                PQclear(res_);
+            if(!exec_query(sql))
                 return {};
-            }
 
             std::vector<T> v;
             auto ntuples = PQntuples(res_);
@@ -344,6 +734,29 @@ namespace ormpp{
             return sql;
         }
 
+        struct guard_stream{
+            guard_stream(postgresql& db):db_(db){}
+            void dismiss(){
+                dismiss_ = true;
+            }
+
+            ~guard_stream(){
+                if(dismiss_)
+                    return;
+
+                if(db_.res_!=nullptr)
+                    PQclear(db_.res_);
+                db_.cancel();
+                while((db_.res_ = PQgetResult(db_.con_))!=nullptr){
+                    PQclear(db_.res_);
+                }
+            }
+
+        private:
+            postgresql& db_;
+            bool dismiss_ = false;
+        };
+
         struct guard_result{
             guard_result(PGresult* res):res_(res){}
             void dismiss(){
@@ -375,8 +788,8 @@ namespace ormpp{
             std::string sql = std::string("CREATE TABLE IF NOT EXISTS ") + name.data()+"(";
             auto arr = iguana::get_array<T>();
             constexpr const size_t SIZE = sizeof... (Args);
-            auto_key_map_[name.data()] = "";
-            key_map_[name.data()] = "";
+            auto_key_map()[name.data()] = "";
+            key_map()[name.data()] = "";
 
             //auto_increment_key and key can't exist at the same time			
 			using U = std::tuple<std::decay_t <Args>...>;
@@ -416,7 +829,7 @@ namespace ormpp{
                     }
                     append(sql, " PRIMARY KEY ");
 
-                    key_map_[name.data()] = item.fields;
+                    key_map()[name.data()] = item.fields;
                 }
                     else if constexpr (std::is_same_v<decltype(item), ormpp_auto_key>){
                     if(!has_add_field){
@@ -424,8 +837,8 @@ namespace ormpp{
                         has_add_field = true;
                     }
                     append(sql, " serial primary key");
-                    auto_key_map_[name.data()] = item.fields;
-                    key_map_[name.data()] = item.fields;
+                    auto_key_map()[name.data()] = item.fields;
+                    key_map()[name.data()] = item.fields;
                 }
 					else if constexpr (std::is_same_v<decltype(item), ormpp_unique>) {
 						if (!has_add_field) {
@@ -453,17 +866,123 @@ namespace ormpp{
             return sql;
         }
 
-        template<typename T>
-        bool prepare(const std::string& sql){
-            res_ = PQprepare(con_, "", sql.data(), (int)iguana::get_value<T>(), nullptr);
-            if (PQresultStatus(res_) != PGRES_COMMAND_OK){
-                std::cout<<PQresultErrorMessage(res_)<<std::endl;
+        //the named statement of sql on this connection, it is prepared at the first time and then
+        //planned once by the server, the result format of a query is decided by describing it.
+        //the statement evicted from stmt_cache_ is deallocated, the names are never reused.
+        std::shared_ptr<pg_statement> prepare_statement(const std::string& sql, int nparams, const Oid* types, bool is_query){
+            return stmt_cache_.get_or_prepare(sql, [this, nparams, types, is_query](const std::string& s){
+                std::string name = "ormpp_stmt_" + std::to_string(++stmt_id_);
+                res_ = PQprepare(con_, name.data(), s.data(), nparams, types);
+                if (PQresultStatus(res_) != PGRES_COMMAND_OK){
+                    std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                    PQclear(res_);
+                    return std::shared_ptr<pg_statement>{};
+                }
                 PQclear(res_);
-                return false;
+
+                std::shared_ptr<pg_statement> stmt(new pg_statement{name, 0}, [this](pg_statement* p){
+                    if(con_!=nullptr){
+                        auto sql = "DEALLOCATE " + p->name;
+                        PQclear(PQexec(con_, sql.data()));
+                    }
+                    delete p;
+                });
+
+                if(is_query){
+                    res_ = PQdescribePrepared(con_, name.data());
+                    if(PQresultStatus(res_)==PGRES_COMMAND_OK&&is_binary_supported(res_))
+                        stmt->result_format = 1;
+                    PQclear(res_);
+                }
+
+                return stmt;
+            });
+        }
+
+        template<typename T>
+        std::string generate_copy_sql(){
+            constexpr auto SIZE = iguana::get_value<T>();
+            std::string sql = "COPY ";
+            sql += iguana::get_name<T>().data();
+            sql += "(";
+            for (size_t i = 0; i < SIZE; ++i) {
+                sql += iguana::get_name<T>(i).data();
+                if(i<SIZE-1)
+                    sql+=", ";
             }
-            PQclear(res_);
+            sql += ") FROM STDIN (FORMAT binary)";
+            return sql;
+        }
 
-            return true;
+        template<typename U>
+        static void to_network(char* p, U value){
+            using UU = std::make_unsigned_t<U>;
+            UU v = (UU)value;
+            for (size_t i = 0; i < sizeof(U); ++i) {
+                p[i] = (char)(v >> (8 * (sizeof(U) - 1 - i)));
+            }
+        }
+
+        template<typename U>
+        static void append_network(std::string& buf, U value){
+            char temp[sizeof(U)];
+            to_network(temp, value);
+            buf.append(temp, sizeof(U));
+        }
+
+        //the binary send format of the column types created by type_to_name, it is the same in
+        //COPY BINARY and binary parameters. bool is an integer column, char is a char(1) column
+        //which is filled with the text of the number, the same as the text format.
+        template<typename U>
+        static size_t binary_length(const U& value){
+            if constexpr(std::is_same_v<U, bool>){
+                return sizeof(int32_t);
+            }
+            else if constexpr(std::is_same_v<U, char>){
+                return std::to_string((int)value).size();
+            }
+            else if constexpr(std::is_arithmetic_v<U>){
+                return sizeof(U);
+            }
+            else if constexpr(std::is_same_v<std::string, U>){
+                return value.size();
+            }
+            else if constexpr(is_char_array_v<U>) {
+                return strnlen(value, sizeof(U));
+            }
+            else {
+                static_assert(is_char_array_v<U>, "this type has not supported yet");
+            }
+        }
+
+        template<typename U>
+        static void to_binary(char* p, const U& value){
+            if constexpr(std::is_same_v<U, bool>){
+                to_network(p, (int32_t)value);
+            }
+            else if constexpr(std::is_same_v<U, char>){
+                auto s = std::to_string((int)value);
+                memcpy(p, s.data(), s.size());
+            }
+            else if constexpr(std::is_integral_v<U>){
+                to_network(p, value);
+            }
+            else if constexpr(std::is_same_v<U, float>){
+                uint32_t v;
+                memcpy(&v, &value, sizeof(v));
+                to_network(p, v);
+            }
+            else if constexpr(std::is_same_v<U, double>){
+                uint64_t v;
+                memcpy(&v, &value, sizeof(v));
+                to_network(p, v);
+            }
+            else if constexpr(std::is_same_v<std::string, U>){
+                memcpy(p, value.data(), value.size());
+            }
+            else if constexpr(is_char_array_v<U>) {
+                memcpy(p, value, strnlen(value, sizeof(U)));
+            }
         }
 
         template<typename T>
@@ -486,27 +1005,95 @@ namespace ormpp{
             return sql;
         }
 
-        template<typename T, typename... Args>
-        constexpr int insert_impl(const std::string& sql, const T& t, Args&&... args) {
-            std::vector<std::vector<char>> param_values;
-            auto it = auto_key_map_.find(iguana::get_name<T>().data());
-            std::string auto_key = (it==auto_key_map_.end())?"":it->second;
-
-            iguana::for_each(t, [&t, &param_values, &auto_key, this](auto item, auto i){
-                /*if(!auto_key.empty()&&auto_key==iguana::get_name<T>(decltype(i)::value).data())
-                    return;*/
-                set_param_values(param_values, t.*item);
-            });
+        //returns the number of the affected rows
+        template<typename T>
+        int insert_impl(const std::string& stmt_name, const T& t, pg_params<T>& params) {
+            set_param_values(params, t);
+            res_ = PQexecPrepared(con_, stmt_name.data(), (int)pg_params<T>::SIZE, params.values.data(), params.lengths.data(), params.formats.data(), 0);
 
-            if(param_values.empty())
+            if (PQresultStatus(res_) != PGRES_COMMAND_OK){
+                std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                PQclear(res_);
+                return INT_MIN;
+            }
+
+            int rows = std::atoi(PQcmdTuples(res_));
+            PQclear(res_);
+
+            return rows;
+        }
+
+        //insert into t(...) values($1, ...), ($n+1, ...) on conflict(key) do update set a=excluded.a
+        template<typename T>
+        std::string generate_upsert_sql(size_t rows, const std::vector<std::string_view>& fields){
+            auto it = key_map().find(iguana::get_name<T>().data());
+            if(it==key_map().end()||it->second.empty()){
+                std::cout<<"upsert needs the key of "<<iguana::get_name<T>()<<std::endl;
+                return "";
+            }
+
+            constexpr auto SIZE = iguana::get_value<T>();
+            std::string sql = generate_auto_insert_sql<T>(false);
+            for (size_t row = 1; row < rows; ++row) {
+                sql += ",(";
+                for (size_t i = 0; i < SIZE; ++i) {
+                    sql += "$" + std::to_string(row * SIZE + i + 1);
+                    if(i<SIZE-1)
+                        sql += ", ";
+                }
+                sql += ")";
+            }
+
+            append(sql, " on conflict(", it->second, ") do update set ");
+            bool first = true;
+            for (auto field : get_upsert_fields<T>(it->second, fields)) {
+                if(!first)
+                    sql += ", ";
+                first = false;
+                sql += std::string(field) + "=excluded." + std::string(field);
+            }
+
+            return sql;
+        }
+
+        //the params of every row are encoded by set_param_values, then they are sent together.
+        //the partial chunk at the end isn't prepared, it is not likely to be used again.
+        template<typename T>
+        int upsert_chunk(const std::vector<T>& v, size_t begin, size_t end, const std::vector<std::string_view>& fields){
+            constexpr auto SIZE = iguana::get_value<T>();
+            const size_t rows = end - begin;
+            auto sql = generate_upsert_sql<T>(rows, fields);
+            if(sql.empty())
                 return INT_MIN;
 
-            std::vector<const char*> param_values_buf;
-            for(auto& item : param_values){
-                param_values_buf.push_back(item.data());
+            std::vector<pg_params<T>> params(rows);
+            std::vector<const char*> values;
+            std::vector<int> lengths;
+            std::vector<int> formats;
+            std::vector<Oid> types;
+            values.reserve(rows * SIZE);
+            lengths.reserve(rows * SIZE);
+            formats.reserve(rows * SIZE);
+            types.reserve(rows * SIZE);
+            for (size_t i = 0; i < rows; ++i) {
+                set_param_values(params[i], v[begin + i]);
+                values.insert(values.end(), params[i].values.begin(), params[i].values.end());
+                lengths.insert(lengths.end(), params[i].lengths.begin(), params[i].lengths.end());
+                formats.insert(formats.end(), params[i].formats.begin(), params[i].formats.end());
+                types.insert(types.end(), pg_params<T>::types.begin(), pg_params<T>::types.end());
             }
 
-            res_ = PQexecPrepared(con_, "", (int)param_values.size(), param_values_buf.data(), NULL,NULL,0);
+            const int nparams = (int)(rows * SIZE);
+            if(rows==max_params / SIZE){
+                auto stmt = prepare_statement(sql, nparams, types.data(), false);
+                if(stmt==nullptr)
+                    return INT_MIN;
+
+                res_ = PQexecPrepared(con_, stmt->name.data(), nparams, values.data(), lengths.data(), formats.data(), 0);
+            }
+            else{
+                res_ = PQexecParams(con_, sql.data(), nparams, types.data(), values.data(), lengths.data(), formats.data(), 0);
+            }
 
             if (PQresultStatus(res_) != PGRES_COMMAND_OK){
                 std::cout<<PQresultErrorMessage(res_)<<std::endl;
@@ -514,48 +1101,236 @@ namespace ormpp{
                 return INT_MIN;
             }
 
+            int result = std::atoi(PQcmdTuples(res_));
             PQclear(res_);
+            return result;
+        }
 
-            return 1;
+        template<typename T, typename K>
+        static void set_key(T& t, size_t index, const K& key){
+            iguana::for_each(t, [&t, index, &key](auto item, auto I){
+                using U = std::remove_reference_t<decltype(t.*item)>;
+                if constexpr(std::is_assignable_v<U&, const K&>){
+                    if(decltype(I)::value==index)
+                        t.*item = key;
+                }
+            });
         }
 
+        //the index of the key field, or the number of the fields if the table has no key
         template<typename T>
-        constexpr void set_param_values(std::vector<std::vector<char>>& param_values, T&& value){
-            using U = std::remove_const_t<std::remove_reference_t<T>>;
-            if constexpr(std::is_integral_v<U>&&!iguana::is_int64_v<U>){
-                std::vector<char> temp(20, 0);
-                itoa_fwd(value, temp.data());
-                param_values.push_back(std::move(temp));
+        size_t key_index(){
+            auto it = key_map().find(iguana::get_name<T>().data());
+            if(it==key_map().end()||it->second.empty())
+                return iguana::get_value<T>();
+
+            return get_field_index<T>(it->second);
+        }
+
+        //one prepared statement for all the rows in a transaction
+        template<typename T>
+        int update_by_key(const std::vector<T>& v, size_t index){
+            if(!begin())
+                return INT_MIN;
+
+            auto stmt = prepare_statement(generate_update_sql<T>(iguana::get_name<T>(), index, "$"), (int)iguana::get_value<T>(), pg_params<T>::types.data(), false);
+            if(stmt==nullptr){
+                rollback();
+                return INT_MIN;
             }
-            else if constexpr (iguana::is_int64_v<U>){
-                std::vector<char> temp(65, 0);
-                xtoa(value, temp.data(), 10, std::is_signed_v<U>);
-                param_values.push_back(std::move(temp));
+
+            int rows = 0;
+            pg_params<T> params;
+            for(auto& item : v){
+                auto result = insert_impl(stmt->name, item, params);
+                if(result==INT_MIN){
+                    rollback();
+                    return INT_MIN;
+                }
+                rows += result;
             }
-            else if constexpr (std::is_floating_point_v<U>){
-                std::vector<char> temp(20, 0);
-                sprintf(temp.data(), "%f", value);
-                param_values.push_back(std::move(temp));
+
+            if(!commit())
+                return INT_MIN;
+
+            return rows;
+        }
+
+        //the fixed size fields are encoded into params.data, the strings are referenced in place
+        template<typename T>
+        void set_param_values(pg_params<T>& params, const T& t){
+            iguana::for_each(t, [&t, &params](auto item, auto I){
+                constexpr auto Idx = decltype(I)::value;
+                using U = std::remove_const_t<std::remove_reference_t<decltype(t.*item)>>;
+                auto& value = t.*item;
+                if constexpr(pg_fixed_param_size<U>()>0){
+                    char* p = params.data.data() + pg_params<T>::offsets[Idx];
+                    to_binary(p, value);
+                    params.values[Idx] = p;
+                    params.lengths[Idx] = (int)binary_length(value);
+                }
+                else if constexpr(std::is_same_v<std::string, U>){
+                    params.values[Idx] = value.data();
+                    params.lengths[Idx] = (int)value.size();
+                }
+                else if constexpr(is_char_array_v<U>) {
+                    params.values[Idx] = value;
+                    params.lengths[Idx] = (int)binary_length(value);
+                }
+                else {
+                    static_assert(is_char_array_v<U>, "this type has not supported yet");
+                }
+            });
+        }
+
+        //the values are inlined in the sql of query, so it is sent as an unnamed statement in a single
+        //round trip and isn't cached, the named statements are kept for the sql with placeholders.
+        //the result is requested in binary format, unless there is a column type which can't be
+        //decoded from binary, such as numeric or timestamp, then it is requested again in text format.
+        bool exec_query(const std::string& sql){
+            res_ = PQexecParams(con_, sql.data(), 0, nullptr, nullptr, nullptr, nullptr, 1);
+            if (PQresultStatus(res_)==PGRES_TUPLES_OK&&!is_binary_supported(res_)){
+                PQclear(res_);
+                res_ = PQexecParams(con_, sql.data(), 0, nullptr, nullptr, nullptr, nullptr, 0);
+            }
+
+            if (PQresultStatus(res_) != PGRES_TUPLES_OK){
+                std::cout<<PQresultErrorMessage(res_)<<std::endl;
+                PQclear(res_);
+                return false;
+            }
+
+            return true;
+        }
+
+        void cancel(){
+            PGcancel* c = PQgetCancel(con_);
+            if(c==nullptr)
+                return;
+
+            char err[256];
+            if(!PQcancel(c, err, sizeof(err)))
+                std::cout<<err<<std::endl;
+            PQfreeCancel(c);
+        }
+
+        static bool is_binary_supported(const PGresult* res){
+            int nfields = PQnfields(res);
+            for (int i = 0; i < nfields; ++i) {
+                switch (PQftype(res, i)) {
+                    case BOOLOID: case CHAROID: case INT2OID: case INT4OID: case INT8OID:
+                    case FLOAT4OID: case FLOAT8OID: case TEXTOID: case VARCHAROID: case BPCHAROID: case NAMEOID:
+                        break;
+                    default:
+                        return false;
+                }
+            }
+
+            return true;
+        }
+
+        template<typename N>
+        static N from_network(const char* p){
+            std::make_unsigned_t<N> v = 0;
+            for (size_t i = 0; i < sizeof(N); ++i) {
+                v = (v << 8) | (unsigned char)p[i];
+            }
+            return (N)v;
+        }
+
+        template<typename U, typename N>
+        static void assign_number(U& value, N n){
+            if constexpr(std::is_arithmetic_v<U>){
+                value = (U)n;
             }
             else if constexpr(std::is_same_v<std::string, U>){
-                std::vector<char> temp = {};
-                std::copy(value.data(), value.data()+value.size()+1, std::back_inserter(temp));
-//                    std::cout<<value.size()<<std::endl;
-                param_values.push_back(std::move(temp));
+                value = std::to_string(n);
             }
-			else if constexpr(is_char_array_v<U>) {
-				std::vector<char> temp = {};
-				std::copy(value, value+sizeof(U), std::back_inserter(temp));
-				param_values.push_back(std::move(temp));
-			}
-            else {
-                std::cout<<"this type has not supported yet"<<std::endl;
+            else if constexpr(is_char_array_v<U>) {
+                auto s = std::to_string(n);
+                strncpy(value, s.data(), sizeof(U));
+            }
+        }
+
+        //the text types, libpq always appends a zero byte to the value
+        template<typename U>
+        static void assign_text(U& value, const char* p, int len){
+            if constexpr(std::is_floating_point_v<U>){
+                value = (U)std::atof(p);
+            }
+            else if constexpr(std::is_arithmetic_v<U>){
+                value = (U)std::atoll(p);
+            }
+            else if constexpr(std::is_same_v<std::string, U>){
+                value.assign(p, len);
+            }
+            else if constexpr(is_char_array_v<U>) {
+                memset(value, 0, sizeof(U));
+                memcpy(value, p, (std::min)((size_t)len, sizeof(U)));
+            }
+        }
+
+        template<typename U>
+        void assign_binary(U& value, int row, int i){
+            const char* p = PQgetvalue(res_, row, i);
+            switch (PQftype(res_, i)) {
+                case BOOLOID:
+                case CHAROID:
+                    assign_number(value, (int)p[0]);
+                    break;
+                case INT2OID:
+                    assign_number(value, from_network<int16_t>(p));
+                    break;
+                case INT4OID:
+                    assign_number(value, from_network<int32_t>(p));
+                    break;
+                case INT8OID:
+                    assign_number(value, from_network<int64_t>(p));
+                    break;
+                case FLOAT4OID: {
+                    auto v = from_network<uint32_t>(p);
+                    float f;
+                    memcpy(&f, &v, sizeof(f));
+                    assign_number(value, f);
+                    break;
+                }
+                case FLOAT8OID: {
+                    auto v = from_network<uint64_t>(p);
+                    double d;
+                    memcpy(&d, &v, sizeof(d));
+                    assign_number(value, d);
+                    break;
+                }
+                default:
+                    assign_text(value, p, PQgetlength(res_, row, i));
+                    break;
             }
         }
 
         template<typename T>
         constexpr void assign(T&& value, int row, int i){
             using U = std::remove_const_t<std::remove_reference_t<T>>;
+            if(PQgetisnull(res_, row, i)){
+                //the value may be reused by query_stream
+                if constexpr(std::is_arithmetic_v<U>){
+                    value = 0;
+                }
+                else if constexpr(std::is_same_v<std::string, U>){
+                    value.clear();
+                }
+                else if constexpr(is_char_array_v<U>){
+                    memset(value, 0, sizeof(U));
+                }
+                return;
+            }
+
+            if(PQfformat(res_, i)==1){
+                if constexpr(std::is_arithmetic_v<U>||std::is_same_v<std::string, U>||is_char_array_v<U>){
+                    assign_binary(value, row, i);
+                    return;
+                }
+            }
+
             if constexpr(std::is_integral_v<U>&&!iguana::is_int64_v<U>){
                 value = std::atoi(PQgetvalue(res_, row, i));
             }
@@ -631,12 +1406,12 @@ namespace ormpp{
 
             std::string fields = "(";
             std::string values = " values(";
-            auto it = auto_key_map_.find(name.data());
+            auto it = auto_key_map().find(name.data());
 
             int index = 0;
             for (auto i = 0; i < SIZE; ++i) {
                 std::string field_name = iguana::get_name<T>(i).data();
-                //if(it!=auto_key_map_.end()&&it->second==field_name)
+                //if(it!=auto_key_map().end()&&it->second==field_name)
                 //    continue;
 
                 values+="$";
@@ -659,10 +1434,24 @@ namespace ormpp{
             return sql;
         }
 
+        std::map<std::string, std::string>& auto_key_map() const{
+            return keys_->auto_key_map;
+        }
+
+        std::map<std::string, std::string>& key_map() const{
+            return keys_->key_map;
+        }
+
         PGresult *res_ = nullptr;
         PGconn* con_ = nullptr;
-        std::map<std::string, std::string> auto_key_map_;
-        std::map<std::string, std::string> key_map_;
+        //shared by the connections to the same database, so the ones which didn't create the tables know their keys
+        std::shared_ptr<table_keys> keys_ = std::make_shared<table_keys>();
+        statement_cache<pg_statement> stmt_cache_;
+        uint64_t stmt_id_ = 0;
+        //the params of a statement are counted by a 16 bits integer in the protocol
+        static constexpr size_t max_params = 65535;
+        size_t copy_threshold_ = 1000;
+        size_t copy_flush_size_ = 1024 * 1024;
     };
 }
 #endif //ORM_POSTGRESQL_HPP
@@ -0,0 +1,187 @@
+#ifndef ORMPP_QUERY_CACHE_HPP
+#define ORMPP_QUERY_CACHE_HPP
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "iguana/reflection.hpp"
+
+namespace ormpp{
+    struct query_cache_stats{
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        //removed to keep the cache in its capacity
+        uint64_t evictions = 0;
+        //removed because the table was written or the ttl expired
+        uint64_t invalidations = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    //the results of dbng::query<T>, keyed by the table and the arguments of the query, in lru order.
+    //only the types with a ttl are cached. the writes through a dbng which uses the cache invalidate
+    //the table, so it can be shared by all the connections of a pool, such as in the warm up of the
+    //pool: conn.set_query_cache(&cache). the writes by other clients are only seen after the ttl.
+    class query_cache{
+    public:
+        explicit query_cache(size_t max_entries = 10000, size_t max_bytes = 64 * 1024 * 1024) :
+            max_entries_(max_entries), max_bytes_(max_bytes){}
+
+        query_cache(const query_cache&) = delete;
+        query_cache& operator=(const query_cache&) = delete;
+
+        template<typename T>
+        void set_ttl(std::chrono::milliseconds ttl){
+            std::unique_lock<std::mutex> lock(mtx_);
+            tables_[std::string(iguana::get_name<T>())].ttl = ttl;
+        }
+
+        template<typename T>
+        bool is_cached(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto it = tables_.find(std::string(iguana::get_name<T>()));
+            return it!=tables_.end()&&it->second.ttl.count()>0;
+        }
+
+        //the version of the table, a result is only put if the table isn't written during its query
+        template<typename T>
+        uint64_t version(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            return tables_[std::string(iguana::get_name<T>())].version;
+        }
+
+        template<typename T>
+        bool get(const std::string& key, std::vector<T>& v){
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto it = entries_.find(key);
+            if(it==entries_.end()){
+                misses_++;
+                return false;
+            }
+
+            auto& e = *it->second;
+            if(e.version!=e.table->version||std::chrono::steady_clock::now()>=e.expire_time){
+                invalidations_++;
+                misses_++;
+                erase(it);
+                return false;
+            }
+
+            hits_++;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            v = *std::static_pointer_cast<const std::vector<T>>(e.value);
+            return true;
+        }
+
+        template<typename T>
+        void put(const std::string& key, uint64_t version, const std::vector<T>& v){
+            size_t bytes = key.size() + estimate_size(v);
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto& table = tables_[std::string(iguana::get_name<T>())];
+            if(table.ttl.count()==0||table.version!=version||bytes>max_bytes_)
+                return;
+
+            if(auto it = entries_.find(key); it!=entries_.end())
+                erase(it);
+
+            lru_.push_front(entry{key, &table, version, std::chrono::steady_clock::now() + table.ttl,
+                                  std::make_shared<const std::vector<T>>(v), bytes});
+            entries_.emplace(key, lru_.begin());
+            bytes_ += bytes;
+
+            while(entries_.size()>max_entries_||bytes_>max_bytes_){
+                evictions_++;
+                erase(entries_.find(lru_.back().key));
+            }
+        }
+
+        //the entries of the table are dropped when they are read
+        template<typename T>
+        void invalidate(){
+            invalidate(iguana::get_name<T>());
+        }
+
+        void invalidate(std::string_view table){
+            std::unique_lock<std::mutex> lock(mtx_);
+            tables_[std::string(table)].version++;
+        }
+
+        //such as after a raw sql is executed
+        void invalidate_all(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            for (auto& table : tables_) {
+                table.second.version++;
+            }
+        }
+
+        void clear(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            entries_.clear();
+            lru_.clear();
+            bytes_ = 0;
+        }
+
+        query_cache_stats stats(){
+            std::unique_lock<std::mutex> lock(mtx_);
+            return {hits_, misses_, evictions_, invalidations_, entries_.size(), bytes_};
+        }
+
+    private:
+        struct table_info{
+            std::chrono::milliseconds ttl{0};
+            uint64_t version = 0;
+        };
+
+        struct entry{
+            std::string key;
+            //the nodes of tables_ are stable
+            table_info* table;
+            uint64_t version;
+            std::chrono::steady_clock::time_point expire_time;
+            std::shared_ptr<const void> value;
+            size_t bytes;
+        };
+
+        using entry_iterator = std::list<entry>::iterator;
+
+        void erase(std::unordered_map<std::string, entry_iterator>::iterator it){
+            bytes_ -= it->second->bytes;
+            lru_.erase(it->second);
+            entries_.erase(it);
+        }
+
+        //the size of the rows and the strings in them
+        template<typename T>
+        static size_t estimate_size(const std::vector<T>& v){
+            size_t size = sizeof(T) * v.size();
+            for (auto& t : v) {
+                iguana::for_each(t, [&t, &size](auto item, auto){
+                    if constexpr(std::is_same_v<std::string, std::remove_const_t<std::remove_reference_t<decltype(t.*item)>>>)
+                        size += (t.*item).size();
+                });
+            }
+            return size;
+        }
+
+        size_t max_entries_;
+        size_t max_bytes_;
+
+        std::mutex mtx_;
+        std::unordered_map<std::string, table_info> tables_;
+        std::list<entry> lru_;
+        std::unordered_map<std::string, entry_iterator> entries_;
+        size_t bytes_ = 0;
+        uint64_t hits_ = 0;
+        uint64_t misses_ = 0;
+        uint64_t evictions_ = 0;
+        uint64_t invalidations_ = 0;
+    };
+}
+
+#endif //ORMPP_QUERY_CACHE_HPP
@@ -0,0 +1,236 @@
+#ifndef ORMPP_RW_ROUTER_HPP
+#define ORMPP_RW_ROUTER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <random>
+#include <vector>
+#include "connection_pool.hpp"
+
+namespace ormpp{
+    //read/write splitting over a primary pool and replica pools: the queries of a session go to a
+    //replica, the writes and transactions go to the primary. after a write the reads of the same
+    //session stay on the primary for pin_window, so the session can read its own writes.
+    template<typename DB>
+    class rw_router{
+    public:
+        class session;
+
+        rw_router(connection_pool<DB>& primary, const std::vector<connection_pool<DB>*>& replicas = {},
+                  std::chrono::milliseconds pin_window = std::chrono::milliseconds(1000)) :
+            primary_(primary), pin_window_(pin_window){
+            for (auto pool : replicas) {
+                replicas_.emplace_back(std::make_unique<replica>(pool));
+            }
+        }
+
+        rw_router(const rw_router&) = delete;
+        rw_router& operator=(const rw_router&) = delete;
+
+        session get_session(){
+            return session(this);
+        }
+
+        //the moving average of the query latency of every replica, in microseconds
+        std::vector<uint64_t> replica_latencies() const{
+            std::vector<uint64_t> v;
+            for (auto& r : replicas_) {
+                v.push_back(r->latency.load(std::memory_order_relaxed));
+            }
+            return v;
+        }
+
+        class session{
+        public:
+            session(session&& other) noexcept : router_(other.router_), conn_(std::move(other.conn_)),
+                last_write_(other.last_write_){
+                other.conn_ = nullptr;
+            }
+
+            session(const session&) = delete;
+            session& operator=(const session&) = delete;
+            session& operator=(session&&) = delete;
+
+            //an unfinished transaction is rolled back
+            ~session(){
+                if(conn_==nullptr)
+                    return;
+
+                try{
+                    rollback();
+                }
+                catch(...){
+                    //the state of its transaction is unknown, so it is dropped
+                    router_->primary_.return_back(nullptr);
+                }
+            }
+
+            template<typename T, typename... Args>
+            std::vector<T> query(Args&&... args){
+                if(conn_!=nullptr)
+                    return conn_->template query<T>(args...);
+
+                if(!pinned()){
+                    auto r = router_->pick_replica();
+                    std::shared_ptr<DB> conn = r==nullptr ? nullptr : r->pool->get();
+                    if(conn!=nullptr){
+                        conn_guard<DB> guard(conn, *r->pool);
+                        auto begin = std::chrono::steady_clock::now();
+                        auto v = conn->template query<T>(args...);
+                        router_->record_latency(*r, begin);
+                        return v;
+                    }
+                }
+
+                return on_primary([&](DB& db){ return db.template query<T>(args...); }, std::vector<T>{}, false);
+            }
+
+            template<typename T, typename... Args>
+            int insert(const T& t, Args&&... args){
+                return on_primary([&](DB& db){ return db.insert(t, args...); }, INT_MIN, true);
+            }
+
+            template<typename T, typename... Args>
+            int insert(const std::vector<T>& t, Args&&... args){
+                return on_primary([&](DB& db){ return db.insert(t, args...); }, INT_MIN, true);
+            }
+
+            template<typename T, typename... Args>
+            int update(const T& t, Args&&... args){
+                return on_primary([&](DB& db){ return db.update(t, args...); }, INT_MIN, true);
+            }
+
+            template<typename T, typename... Args>
+            int update(const std::vector<T>& t, Args&&... args){
+                return on_primary([&](DB& db){ return db.update(t, args...); }, INT_MIN, true);
+            }
+
+            template<typename T, typename... Args>
+            bool delete_records(Args&&... where_conditon){
+                return on_primary([&](DB& db){ return db.template delete_records<T>(where_conditon...); }, false, true);
+            }
+
+            bool execute(const std::string& sql){
+                return on_primary([&](DB& db){ return db.execute(sql); }, false, true);
+            }
+
+            //the transaction holds a primary connection until commit or rollback
+            bool begin(){
+                if(conn_!=nullptr)
+                    return false;
+
+                conn_ = router_->primary_.get();
+                if(conn_==nullptr)
+                    return false;
+
+                if(!conn_->begin()){
+                    release();
+                    return false;
+                }
+
+                return true;
+            }
+
+            bool commit(){
+                if(conn_==nullptr)
+                    return false;
+
+                bool r = conn_->commit();
+                release();
+                return r;
+            }
+
+            bool rollback(){
+                if(conn_==nullptr)
+                    return false;
+
+                bool r = conn_->rollback();
+                release();
+                return r;
+            }
+
+        private:
+            friend class rw_router;
+            explicit session(rw_router* router) : router_(router){}
+
+            bool pinned() const{
+                return std::chrono::steady_clock::now() - last_write_ < router_->pin_window_;
+            }
+
+            void release(){
+                router_->primary_.return_back(conn_);
+                conn_ = nullptr;
+                last_write_ = std::chrono::steady_clock::now();
+            }
+
+            template<typename F, typename R>
+            R on_primary(F&& f, R failed, bool write){
+                if(conn_!=nullptr)
+                    return f(*conn_);
+
+                auto conn = router_->primary_.get();
+                if(conn==nullptr)
+                    return failed;
+
+                //returned back even if f throws, such as the mysql_exception of dbng<mysql>
+                conn_guard<DB> guard(conn, router_->primary_);
+                auto r = f(*conn);
+                if(write)
+                    last_write_ = std::chrono::steady_clock::now();
+                return r;
+            }
+
+            rw_router* router_;
+            std::shared_ptr<DB> conn_;
+            std::chrono::steady_clock::time_point last_write_;
+        };
+
+    private:
+        struct replica{
+            explicit replica(connection_pool<DB>* p) : pool(p){}
+            connection_pool<DB>* pool;
+            std::atomic<uint64_t> latency{0};
+        };
+
+        //a random replica weighted by the inverse of its latency, so the slow ones get less reads
+        replica* pick_replica(){
+            if(replicas_.empty())
+                return nullptr;
+            if(replicas_.size()==1)
+                return replicas_[0].get();
+
+            double total = 0;
+            std::vector<double> weights(replicas_.size());
+            for (size_t i = 0; i < replicas_.size(); ++i) {
+                weights[i] = 1.0 / (replicas_[i]->latency.load(std::memory_order_relaxed) + 1);
+                total += weights[i];
+            }
+
+            static thread_local std::mt19937 gen{std::random_device{}()};
+            double x = std::uniform_real_distribution<double>(0, total)(gen);
+            for (size_t i = 0; i < replicas_.size(); ++i) {
+                if(x<weights[i])
+                    return replicas_[i].get();
+                x -= weights[i];
+            }
+
+            return replicas_.back().get();
+        }
+
+        //exponential moving average, the races between the threads only lose a sample
+        void record_latency(replica& r, std::chrono::steady_clock::time_point begin){
+            auto sample = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin).count();
+            auto old = r.latency.load(std::memory_order_relaxed);
+            r.latency.store(old==0 ? sample : (old * 7 + sample) / 8, std::memory_order_relaxed);
+        }
+
+        connection_pool<DB>& primary_;
+        std::vector<std::unique_ptr<replica>> replicas_;
+        std::chrono::milliseconds pin_window_;
+    };
+}
+
+#endif //ORMPP_RW_ROUTER_HPP
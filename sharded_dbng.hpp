@@ -0,0 +1,283 @@
+#ifndef ORMPP_SHARDED_DBNG_HPP
+#define ORMPP_SHARDED_DBNG_HPP
+
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <future>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "dbng.hpp"
+#include "connection_pool.hpp"
+
+namespace ormpp{
+    //a table split over several databases, every database has its own pool. the rows are routed by
+    //the shard key of the table, the queries without the shard key run on all the shards in
+    //parallel and the results are merged. there is no transaction across the shards.
+    template<typename DB>
+    class sharded_dbng{
+    public:
+        using pool_type = connection_pool<dbng<DB>>;
+        //maps the shard key of a row to the index of a shard
+        using shard_map = std::function<size_t(const std::string& key, size_t shard_num)>;
+
+        explicit sharded_dbng(std::vector<pool_type*> pools, shard_map map = hash_map()) :
+            pools_(std::move(pools)), map_(std::move(map)){}
+
+        //FNV-1a, it must not change between the processes, so std::hash isn't used
+        static shard_map hash_map(){
+            return [](const std::string& key, size_t shard_num){
+                uint64_t h = 14695981039346656037ull;
+                for (unsigned char c : key) {
+                    h = (h ^ c) * 1099511628211ull;
+                }
+                return (size_t)(h % shard_num);
+            };
+        }
+
+        //numeric keys less than upper_bounds[i] are in shard i, the greater ones are in the last shard
+        static shard_map range_map(std::vector<int64_t> upper_bounds){
+            return [upper_bounds = std::move(upper_bounds)](const std::string& key, size_t shard_num){
+                auto v = std::stoll(key);
+                size_t i = 0;
+                while(i<upper_bounds.size()&&v>=upper_bounds[i]){
+                    i++;
+                }
+                return (std::min)(i, shard_num - 1);
+            };
+        }
+
+        //such as: set_shard_key(FID(person::id)), the first field is used if it isn't set
+        template<typename Pair>
+        void set_shard_key(Pair pair){
+            using T = typename field_attribute<decltype(pair.second)>::type;
+            auto member = pair.second;
+            auto& key = keys_[get_name<T>().data()];
+            key.name = std::string(pair.first);
+            key.get = [member](const void* p){
+                return to_key(static_cast<const T*>(p)->*member);
+            };
+        }
+
+        size_t shard_num() const{
+            return pools_.size();
+        }
+
+        template<typename T, typename... Args>
+        int insert(const T& t, Args&&... args){
+            return on_shard(shard_of(t), [&](dbng<DB>& db){ return db.insert(t, args...); }, INT_MIN);
+        }
+
+        template<typename T, typename... Args>
+        int insert(const std::vector<T>& v, Args&&... args){
+            return on_groups(v, [&](dbng<DB>& db, const std::vector<T>& rows){ return db.insert(rows, args...); });
+        }
+
+        template<typename T, typename... Args>
+        int update(const T& t, Args&&... args){
+            return on_shard(shard_of(t), [&](dbng<DB>& db){ return db.update(t, args...); }, INT_MIN);
+        }
+
+        template<typename T, typename... Args>
+        int update(const std::vector<T>& v, Args&&... args){
+            return on_groups(v, [&](dbng<DB>& db, const std::vector<T>& rows){ return db.update(rows, args...); });
+        }
+
+        template<typename T, typename... Args>
+        bool delete_records(Args&&... where_conditon){
+            auto results = scatter([&](dbng<DB>& db){ return db.template delete_records<T>(where_conditon...); }, false);
+            return std::all_of(results.begin(), results.end(), [](bool r){ return r; });
+        }
+
+        //only one shard is used when the condition is "shard key = value"
+        template<typename Pair, typename U>
+        bool delete_records(Pair pair, std::string_view oper, U&& val){
+            using T = typename field_attribute<decltype(pair.second)>::type;
+            if(auto index = shard_of<T>(pair.first, oper, val); index<pools_.size()){
+                return on_shard(index, [&](dbng<DB>& db){ return db.delete_records(pair, oper, val); }, false);
+            }
+
+            auto results = scatter([&](dbng<DB>& db){ return db.delete_records(pair, oper, val); }, false);
+            return std::all_of(results.begin(), results.end(), [](bool r){ return r; });
+        }
+
+        //runs on all the shards in parallel, the results are appended in the order of the shards
+        template<typename T, typename... Args>
+        std::vector<T> query(Args&&... args){
+            auto results = scatter([&](dbng<DB>& db){ return db.template query<T>(args...); }, std::vector<T>{});
+            std::vector<T> v;
+            for (auto& r : results) {
+                v.insert(v.end(), std::make_move_iterator(r.begin()), std::make_move_iterator(r.end()));
+            }
+            return v;
+        }
+
+        template<typename Pair, typename U>
+        auto query(Pair pair, std::string_view oper, U&& val){
+            using T = typename field_attribute<decltype(pair.second)>::type;
+            if(auto index = shard_of<T>(pair.first, oper, val); index<pools_.size()){
+                return on_shard(index, [&](dbng<DB>& db){ return db.query(pair, oper, val); }, std::vector<T>{});
+            }
+
+            auto results = scatter([&](dbng<DB>& db){ return db.query(pair, oper, val); }, std::vector<T>{});
+            std::vector<T> v;
+            for (auto& r : results) {
+                v.insert(v.end(), std::make_move_iterator(r.begin()), std::make_move_iterator(r.end()));
+            }
+            return v;
+        }
+
+        //every shard returns its first limit rows ordered by the field, then they are merged,
+        //such as: query_ordered(FID(person::age), false, 10, "age > 20"), 0 limit means all.
+        template<typename Pair>
+        auto query_ordered(Pair pair, bool asc, size_t limit, const std::string& where = ""){
+            using T = typename field_attribute<decltype(pair.second)>::type;
+            std::string cond = where.empty() ? "1=1" : where;
+            cond += " order by ";
+            cond += pair.first;
+            if(!asc)
+                cond += " desc";
+            if(limit>0)
+                cond += " limit " + std::to_string(limit);
+
+            auto results = scatter([&](dbng<DB>& db){ return db.template query<T>(cond); }, std::vector<T>{});
+
+            auto member = pair.second;
+            auto before = [member, asc](const T& a, const T& b){
+                return asc ? a.*member < b.*member : b.*member < a.*member;
+            };
+
+            //k-way merge, the heap keeps the next row of every shard
+            using cursor = std::pair<size_t, size_t>;
+            auto cmp = [&results, &before](const cursor& a, const cursor& b){
+                return before(results[b.first][b.second], results[a.first][a.second]);
+            };
+            std::priority_queue<cursor, std::vector<cursor>, decltype(cmp)> heap(cmp);
+            for (size_t i = 0; i < results.size(); ++i) {
+                if(!results[i].empty())
+                    heap.push({i, 0});
+            }
+
+            std::vector<T> v;
+            while(!heap.empty()&&(limit==0||v.size()<limit)){
+                auto [i, j] = heap.top();
+                heap.pop();
+                v.push_back(std::move(results[i][j]));
+                if(j + 1<results[i].size())
+                    heap.push({i, j + 1});
+            }
+            return v;
+        }
+
+        //runs on all the shards, such as creating the tables
+        bool execute(const std::string& sql){
+            auto results = scatter([&](dbng<DB>& db){ return db.execute(sql); }, false);
+            return std::all_of(results.begin(), results.end(), [](bool r){ return r; });
+        }
+
+        template<typename T, typename... Args>
+        bool create_datatable(Args&&... args){
+            auto results = scatter([&](dbng<DB>& db){ return db.template create_datatable<T>(args...); }, false);
+            return std::all_of(results.begin(), results.end(), [](bool r){ return r; });
+        }
+
+    private:
+        struct shard_key{
+            std::string name;
+            std::function<std::string(const void*)> get;
+        };
+
+        template<typename U>
+        static std::string to_key(const U& value){
+            if constexpr(std::is_arithmetic_v<U>){
+                return std::to_string(value);
+            }
+            else{
+                return std::string(value);
+            }
+        }
+
+        template<typename T>
+        size_t shard_of(const T& t){
+            auto it = keys_.find(get_name<T>().data());
+            std::string key = it!=keys_.end() ? it->second.get(&t) : to_key(iguana::get<0>(t));
+            return map_(key, pools_.size());
+        }
+
+        //the index of the shard, or shard_num() if the condition isn't on the shard key
+        template<typename T, typename U>
+        size_t shard_of(std::string_view field, std::string_view oper, const U& val){
+            auto it = keys_.find(get_name<T>().data());
+            std::string_view key_name = it!=keys_.end() ? std::string_view(it->second.name) : iguana::get_name<T>(0);
+            if(field!=key_name||oper!="=")
+                return pools_.size();
+
+            if constexpr(std::is_arithmetic_v<U>||std::is_constructible_v<std::string, const U&>){
+                return map_(to_key(val), pools_.size());
+            }
+            else{
+                return pools_.size();
+            }
+        }
+
+        template<typename F, typename R>
+        R on_shard(size_t index, F&& f, R failed){
+            auto& pool = *pools_[index];
+            auto conn = pool.get();
+            if(conn==nullptr)
+                return failed;
+
+            //returned back even if f throws, such as the mysql_exception of dbng<mysql>
+            conn_guard<dbng<DB>> guard(conn, pool);
+            return f(*conn);
+        }
+
+        //f runs on every shard in parallel
+        template<typename F, typename R>
+        std::vector<R> scatter(F&& f, R failed){
+            std::vector<std::future<R>> futures;
+            for (size_t i = 1; i < pools_.size(); ++i) {
+                futures.push_back(std::async(std::launch::async, [this, &f, &failed, i]{
+                    return on_shard(i, f, failed);
+                }));
+            }
+
+            std::vector<R> results;
+            results.push_back(on_shard(0, f, failed));
+            for (auto& fut : futures) {
+                results.push_back(fut.get());
+            }
+            return results;
+        }
+
+        //the rows are grouped by the shards, the affected rows are summed up
+        template<typename T, typename F>
+        int on_groups(const std::vector<T>& v, F&& f){
+            std::vector<std::vector<T>> groups(pools_.size());
+            for (auto& t : v) {
+                groups[shard_of(t)].push_back(t);
+            }
+
+            int total = 0;
+            for (size_t i = 0; i < groups.size(); ++i) {
+                if(groups[i].empty())
+                    continue;
+
+                int r = on_shard(i, [&](dbng<DB>& db){ return f(db, groups[i]); }, INT_MIN);
+                if(r==INT_MIN)
+                    return INT_MIN;
+                total += r;
+            }
+            return total;
+        }
+
+        std::vector<pool_type*> pools_;
+        shard_map map_;
+        std::unordered_map<std::string, shard_key> keys_;
+    };
+}
+
+#endif //ORMPP_SHARDED_DBNG_HPP
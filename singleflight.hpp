@@ -0,0 +1,143 @@
+#ifndef ORMPP_SINGLEFLIGHT_HPP
+#define ORMPP_SINGLEFLIGHT_HPP
+
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+#include "connection_pool.hpp"
+
+namespace ormpp{
+    //the first argument of singleflight::query, the query runs on its own
+    struct no_collapse_t{};
+    inline constexpr no_collapse_t no_collapse{};
+
+    struct singleflight_stats{
+        //the queries sent to the database
+        uint64_t queries = 0;
+        //the queries which waited for the same query of another thread
+        uint64_t collapsed = 0;
+    };
+
+    //the identical queries running at the same time are sent only once: the first one queries on a
+    //pooled connection and the others wait for its result. they are identical if they have the same
+    //type and the same arguments. the result isn't kept after the query, it isn't a cache.
+    template<typename DB>
+    class singleflight{
+    public:
+        explicit singleflight(connection_pool<DB>& pool) : pool_(pool){}
+
+        singleflight(const singleflight&) = delete;
+        singleflight& operator=(const singleflight&) = delete;
+
+        //the same as DB::query, such as: query<person>("id = 1"), query<person>(no_collapse, "id = 1")
+        template<typename T, typename... Args>
+        std::vector<T> query(Args&&... args){
+            auto key = make_key<T>(args...);
+            std::shared_ptr<call<T>> c;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto it = calls_.find(key);
+                if(it!=calls_.end()){
+                    c = std::static_pointer_cast<call<T>>(it->second);
+                    collapsed_.fetch_add(1, std::memory_order_relaxed);
+                    lock.unlock();
+                    return c->future.get();
+                }
+
+                c = std::make_shared<call<T>>();
+                c->future = c->promise.get_future().share();
+                calls_.emplace(key, c);
+            }
+
+            //the call is removed before it is fulfilled, so the later queries don't get an old result
+            try{
+                auto v = run<T>(std::forward<Args>(args)...);
+                remove(key);
+                c->promise.set_value(v);
+                return v;
+            }
+            catch(...){
+                remove(key);
+                c->promise.set_exception(std::current_exception());
+                throw;
+            }
+        }
+
+        template<typename T, typename... Args>
+        std::vector<T> query(no_collapse_t, Args&&... args){
+            return run<T>(std::forward<Args>(args)...);
+        }
+
+        singleflight_stats stats() const{
+            return {queries_.load(std::memory_order_relaxed), collapsed_.load(std::memory_order_relaxed)};
+        }
+
+    private:
+        template<typename T>
+        struct call{
+            std::promise<std::vector<T>> promise;
+            std::shared_future<std::vector<T>> future;
+        };
+
+        template<typename T, typename... Args>
+        static std::string make_key(const Args&... args){
+            std::string key = typeid(T).name();
+            (append_key(key, args), ...);
+            return key;
+        }
+
+        //the arguments are separated by '\0', which isn't in a sql. the type of an arithmetic argument
+        //is kept and a floating point one is printed exactly, so 1e-7 and 2e-7 are different keys.
+        template<typename U>
+        static void append_key(std::string& key, const U& arg){
+            key.push_back('\0');
+            if constexpr(std::is_floating_point_v<U>){
+                char buf[64];
+                snprintf(buf, sizeof(buf), "%.21Lg", (long double)arg);
+                key += typeid(U).name();
+                key.push_back(':');
+                key += buf;
+            }
+            else if constexpr(std::is_arithmetic_v<U>){
+                key += typeid(U).name();
+                key.push_back(':');
+                key += std::to_string(arg);
+            }
+            else{
+                key += arg;
+            }
+        }
+
+        template<typename T, typename... Args>
+        std::vector<T> run(Args&&... args){
+            auto conn = pool_.get();
+            if(conn==nullptr)
+                return {};
+
+            conn_guard<DB> guard(conn, pool_);
+            queries_.fetch_add(1, std::memory_order_relaxed);
+            return conn->template query<T>(std::forward<Args>(args)...);
+        }
+
+        void remove(const std::string& key){
+            std::unique_lock<std::mutex> lock(mtx_);
+            calls_.erase(key);
+        }
+
+        connection_pool<DB>& pool_;
+        std::mutex mtx_;
+        //the values are call<T> of different T
+        std::unordered_map<std::string, std::shared_ptr<void>> calls_;
+        std::atomic<uint64_t> queries_{0};
+        std::atomic<uint64_t> collapsed_{0};
+    };
+}
+
+#endif //ORMPP_SINGLEFLIGHT_HPP
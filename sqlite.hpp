@@ -6,6 +6,7 @@
 #include <climits>
 #include <sqlite3.h>
 #include "utility.hpp"
+#include "statement_cache.hpp"
 
 #ifndef ORM_SQLITE_HPP
 #define ORM_SQLITE_HPP
@@ -25,10 +26,23 @@ namespace ormpp{
 			return last_error_;
 		}
 
+		//a local database has no connection to lose
+		bool ping() {
+			return handle_ != nullptr;
+		}
+
+		bool has_error() {
+			return false;
+		}
+
         template <typename... Args>
         bool connect(Args&&... args){
+            stmt_cache_.clear();
             auto r = sqlite3_open(std::forward<Args>(args)..., &handle_);
 			if (r == SQLITE_OK) {
+                //an in-memory database isn't shared
+                const char* file = sqlite3_db_filename(handle_, "main");
+                keys_ = file!=nullptr&&*file!='\0' ? get_table_keys(std::string("sqlite:") + file) : std::make_shared<table_keys>();
 				return true;
 			}
 			set_last_error(sqlite3_errmsg(handle_));
@@ -38,6 +52,8 @@ namespace ormpp{
         template <typename... Args>
         bool disconnect(Args&&... args){
             if(handle_!= nullptr){
+                //the cached statements must be finalized before the connection is closed
+                stmt_cache_.clear();
                 auto r = sqlite3_close(handle_);
                 handle_ = nullptr;
 				if (r == SQLITE_OK) {
@@ -69,28 +85,28 @@ namespace ormpp{
 
         template<typename T, typename... Args>
         int insert(const T& t,Args&&... args){
-            std::string sql = auto_key_map_.empty()?generate_insert_sql<T>(false): generate_auto_insert_sql0<T>(auto_key_map_, false);
+            std::string sql = auto_key_map().empty()?generate_insert_sql<T>(false): generate_auto_insert_sql0<T>(auto_key_map(), false);
 
             return insert_impl(false, sql, t, std::forward<Args>(args)...);
         }
 
         template<typename T, typename... Args>
         int insert(const std::vector<T>& t, Args&&... args){
-            std::string sql = auto_key_map_.empty()?generate_insert_sql<T>(false): generate_auto_insert_sql0<T>(auto_key_map_, false);
+            std::string sql = auto_key_map().empty()?generate_insert_sql<T>(false): generate_auto_insert_sql0<T>(auto_key_map(), false);
 
             return insert_impl(false, sql, t, std::forward<Args>(args)...);
         }
 
         template<typename T, typename... Args>
         int update(const T& t, Args&&... args) {
-            std::string sql = generate_insert_sql<T>(true);
+            std::string sql = generate_update_sql<T>();
 
             return insert_impl(true, sql, t, std::forward<Args>(args)...);
         }
 
         template<typename T, typename... Args>
         int update(const std::vector<T>& t, Args&&... args){
-            std::string sql = generate_insert_sql<T>(true);
+            std::string sql = generate_update_sql<T>();
 
             return insert_impl(true, sql, t, std::forward<Args>(args)...);
         }
@@ -112,8 +128,8 @@ namespace ormpp{
             std::string sql = generate_query_sql<T>(args...);
             constexpr auto SIZE = iguana::get_value<T>();
 
-            int result = sqlite3_prepare_v2(handle_, sql.data(), (int)sql.size(), &stmt_, nullptr);
-            if (result != SQLITE_OK) {
+            auto stmt = prepare_statement(sql);
+            if (stmt == nullptr) {
 				set_last_error(sqlite3_errmsg(handle_));
 				return {};
             }
@@ -121,6 +137,7 @@ namespace ormpp{
             auto guard = guard_statment(stmt_);
 
             std::vector<T> v;
+            int result = SQLITE_OK;
             while (true)
             {
                 result = sqlite3_step(stmt_);
@@ -142,6 +159,50 @@ namespace ormpp{
             return v;
         }
 
+        //the rows of the keys by the key of the table, the rows are in no particular order and the
+        //missing keys are skipped. see get_key_batch_size for the size of the statements.
+        template<typename T, typename K>
+        std::vector<T> get_many(const std::vector<K>& keys){
+            auto it = key_map().find(get_name<T>());
+            if(it==key_map().end()||it->second.empty()){
+                set_last_error(get_name<T>() + " has no key");
+                return {};
+            }
+
+            std::vector<T> v;
+            size_t begin = 0;
+            while(begin<keys.size()){
+                const size_t count = get_key_batch_size(keys.size() - begin);
+                const size_t end = (std::min)(keys.size(), begin + count);
+                auto stmt = prepare_statement(generate_get_sql<T>(get_name<T>(), it->second, count));
+                if (stmt == nullptr) {
+                    set_last_error(sqlite3_errmsg(handle_));
+                    return {};
+                }
+
+                auto guard = guard_statment(stmt_);
+                for (size_t i = 0; i < count; ++i) {
+                    if(!set_param_bind(keys[(std::min)(begin + i, end - 1)], (int)i + 1)){
+                        set_last_error(sqlite3_errmsg(handle_));
+                        return {};
+                    }
+                }
+
+                while (sqlite3_step(stmt_) == SQLITE_ROW) {
+                    T t = {};
+                    iguana::for_each(t, [this, &t](auto item, auto I)
+                    {
+                        assign(t.*item, (int)decltype(I)::value);
+                    });
+
+                    v.push_back(std::move(t));
+                }
+                begin = end;
+            }
+
+            return v;
+        }
+
         template<typename T, typename Arg, typename... Args>
         std::enable_if_t<!iguana::is_reflection_v<T>, std::vector<T>> query(const Arg& s, Args&&... args){
             static_assert(iguana::is_tuple<T>::value);
@@ -156,8 +217,8 @@ namespace ormpp{
                 sql = get_sql(sql, std::forward<Args>(args)...);
             }
 
-            int result = sqlite3_prepare_v2(handle_, sql.data(), (int)sql.size(), &stmt_, nullptr);
-            if (result != SQLITE_OK) {
+            auto stmt = prepare_statement(sql);
+            if (stmt == nullptr) {
 				set_last_error(sqlite3_errmsg(handle_));
 				return {};
             }
@@ -165,6 +226,7 @@ namespace ormpp{
             auto guard = guard_statment(stmt_);
 
             std::vector<T> v;
+            int result = SQLITE_OK;
             while (true)
             {
                 result = sqlite3_step(stmt_);
@@ -211,6 +273,10 @@ namespace ormpp{
 			return sqlite3_changes(handle_);
 		}
 
+		statement_cache<sqlite3_stmt>& get_statement_cache() {
+			return stmt_cache_;
+		}
+
         //transaction
         bool begin(){
 			if (sqlite3_exec(handle_, "BEGIN", nullptr, nullptr, nullptr) != SQLITE_OK) {
@@ -239,6 +305,69 @@ namespace ormpp{
             return true;
         }
 
+        //update only the fields in the mask by the key, a bit for every field in the order of the fields.
+        //the tables without a key are updated as a whole. fails if the key is in the mask, the row to
+        //update would be unknown.
+        template<typename T>
+        int update_fields(const T& t, uint64_t mask) {
+            auto it = key_map().find(get_name<T>());
+            size_t index = it==key_map().end() ? iguana::get_value<T>() : get_field_index<T>(it->second);
+            if(index>=iguana::get_value<T>())
+                return update(t);
+
+            if(mask&(uint64_t(1)<<index)){
+                set_last_error("the key of " + get_name<T>() + " is changed");
+                return INT_MIN;
+            }
+
+            if(mask==0)
+                return 0;
+
+            auto stmt = prepare_statement(generate_update_fields_sql<T>(get_name<T>(), index, mask));
+            if (stmt == nullptr) {
+                set_last_error(sqlite3_errmsg(handle_));
+                return INT_MIN;
+            }
+
+            auto guard = guard_statment(stmt_);
+
+            bool bind_ok = true;
+            int pos = 1;
+            iguana::for_each(t, [&t, &bind_ok, &pos, mask, this](auto item, auto i){
+                if(bind_ok&&(mask&(uint64_t(1)<<decltype(i)::value)))
+                    bind_ok = set_param_bind(t.*item, pos++);
+            });
+            iguana::for_each(t, [&t, &bind_ok, pos, index, this](auto item, auto i){
+                if(bind_ok&&decltype(i)::value==index)
+                    bind_ok = set_param_bind(t.*item, pos);
+            });
+
+            if (!bind_ok) {
+                set_last_error(sqlite3_errmsg(handle_));
+                return INT_MIN;
+            }
+
+            if (sqlite3_step(stmt_) != SQLITE_DONE) {
+                set_last_error(sqlite3_errmsg(handle_));
+                return INT_MIN;
+            }
+
+            return sqlite3_changes(handle_);
+        }
+
+        //insert ... on conflict(key) do update set ..., it needs sqlite 3.24. the tables without a key
+        //are replaced. returns the number of the inserted or updated rows.
+        template<typename T>
+        int upsert(const T& t, const std::vector<std::string_view>& fields) {
+            return insert_impl(true, generate_upsert_sql<T>(fields), t);
+        }
+
+        //one prepared statement for all the rows in a transaction, like insert(vector)
+        template<typename T>
+        int upsert(const std::vector<T>& v, const std::vector<std::string_view>& fields) {
+            return insert_impl(true, generate_upsert_sql<T>(fields), v);
+        }
+
     private:
         template<typename T, typename... Args >
         std::string generate_createtb_sql(Args&&... args)
@@ -248,7 +377,8 @@ namespace ormpp{
             std::string sql = std::string("CREATE TABLE IF NOT EXISTS ") + name.data()+"(";
             auto arr = iguana::get_array<T>();
             constexpr auto SIZE = sizeof... (Args);
-            auto_key_map_[name.data()] = "";
+            auto_key_map()[name.data()] = "";
+            key_map()[name.data()] = "";
             //auto_increment_key and key can't exist at the same time
 			using U = std::tuple<std::decay_t <Args>...>;
             if constexpr (SIZE>0){
@@ -284,6 +414,7 @@ namespace ormpp{
                     }
 
                     append(sql, " PRIMARY KEY ");
+                    key_map()[name.data()] = item.fields;
                     has_add_field = true;
                 }
                     else if constexpr (std::is_same_v<decltype(item), ormpp_auto_key>){
@@ -291,7 +422,8 @@ namespace ormpp{
                         append(sql, field_name.data(), " ", type_name_arr[i]);
                     }
                     append(sql, " PRIMARY KEY AUTOINCREMENT");
-                    auto_key_map_[name.data()] = item.fields;
+                    auto_key_map()[name.data()] = item.fields;
+                    key_map()[name.data()] = item.fields;
                     has_add_field = true;
                 }
 					else if constexpr (std::is_same_v<decltype(item), ormpp_unique>) {
@@ -320,19 +452,31 @@ namespace ormpp{
             return sql;
         }
 
+        //the statement is owned by stmt_cache_, reset it so that it can be reused next time
         struct guard_statment{
             guard_statment(sqlite3_stmt* stmt):stmt_(stmt){}
             sqlite3_stmt* stmt_= nullptr;
-            int status_ = 0;
             ~guard_statment(){
-                if(stmt_!= nullptr)
-                    status_ = sqlite3_finalize(stmt_);
-
-                if(status_)
-                    fprintf(stderr, "close statment error code %d\n", status_);
+                if(stmt_!= nullptr){
+                    sqlite3_reset(stmt_);
+                    sqlite3_clear_bindings(stmt_);
+                }
             }
         };
 
+        std::shared_ptr<sqlite3_stmt> prepare_statement(const std::string& sql){
+            auto stmt = stmt_cache_.get_or_prepare(sql, [this](const std::string& s){
+                sqlite3_stmt* p = nullptr;
+                if(sqlite3_prepare_v2(handle_, s.data(), (int)s.size(), &p, nullptr)!=SQLITE_OK)
+                    return std::shared_ptr<sqlite3_stmt>{};
+
+                return std::shared_ptr<sqlite3_stmt>(p, sqlite3_finalize);
+            });
+
+            stmt_ = stmt.get();
+            return stmt;
+        }
+
         template<typename T>
         bool set_param_bind(T&& value, int i){
             using U = std::remove_const_t<std::remove_reference_t<T>>;
@@ -383,16 +527,16 @@ namespace ormpp{
 
         template<typename T, typename... Args>
         int insert_impl(bool is_update, const std::string& sql, const T& t, Args&&... args) {
-            int result = sqlite3_prepare_v2(handle_, sql.data(), (int)sql.size(), &stmt_, nullptr);
-            if (result != SQLITE_OK) {
+            auto stmt = prepare_statement(sql);
+            if (stmt == nullptr) {
 				set_last_error(sqlite3_errmsg(handle_));
 				return INT_MIN;
             }
 
             auto guard = guard_statment(stmt_);
 
-            auto it = auto_key_map_.find(get_name<T>());
-            std::string auto_key = (is_update||it==auto_key_map_.end())?"":it->second;
+            auto it = auto_key_map().find(get_name<T>());
+            std::string auto_key = (is_update||it==auto_key_map().end())?"":it->second;
             bool bind_ok = true;
             int index = 0;
             iguana::for_each(t, [&t, &bind_ok, &auto_key, &index, this](auto item, auto i){
@@ -412,19 +556,19 @@ namespace ormpp{
 				return INT_MIN;
             }
 
-            result = sqlite3_step(stmt_);
+            int result = sqlite3_step(stmt_);
             if (result != SQLITE_DONE) {
                 set_last_error(sqlite3_errmsg(handle_));
 				return INT_MIN;
             }
 
-            return 1;
+            return is_update ? sqlite3_changes(handle_) : 1;
         }
 
         template<typename T, typename... Args>
         int insert_impl(bool is_update, const std::string& sql, const std::vector<T>& v, Args&&... args) {
-            int result = sqlite3_prepare_v2(handle_, sql.data(), (int)sql.size(), &stmt_, nullptr);
-			if (result != SQLITE_OK) {
+            auto stmt = prepare_statement(sql);
+			if (stmt == nullptr) {
 				set_last_error(sqlite3_errmsg(handle_));
 				return INT_MIN;
 			}
@@ -437,9 +581,10 @@ namespace ormpp{
 				return INT_MIN;
 			}
 
-            auto it = auto_key_map_.find(get_name<T>());
-            std::string auto_key = (is_update||it==auto_key_map_.end())?"":it->second;
+            auto it = auto_key_map().find(get_name<T>());
+            std::string auto_key = (is_update||it==auto_key_map().end())?"":it->second;
 
+            int changes = 0;
             for(auto& t : v){
                 bool bind_ok = true;
                 int index = 0;
@@ -461,12 +606,13 @@ namespace ormpp{
                     return INT_MIN;
                 }
 
-                result = sqlite3_step(stmt_);
+                int result = sqlite3_step(stmt_);
                 if (result != SQLITE_DONE){
 					rollback();
 					set_last_error(sqlite3_errmsg(handle_));
                     return INT_MIN;
                 }
+                changes += sqlite3_changes(handle_);
 
                 result = sqlite3_reset(stmt_);
                 if (result != SQLITE_OK){
@@ -478,11 +624,42 @@ namespace ormpp{
 
             b = commit();
 
-            return b?(int)v.size():INT_MIN;
+            return b?(is_update?changes:(int)v.size()):INT_MIN;
+        }
+
+        template<typename T>
+        std::string generate_upsert_sql(const std::vector<std::string_view>& fields){
+            auto it = key_map().find(get_name<T>());
+            if(it==key_map().end()||it->second.empty())
+                return generate_insert_sql<T>(true);
+
+            std::string sql = ormpp::generate_auto_insert_sql<T>(auto_key_map(), false);
+            append(sql, "on conflict(", it->second, ") do update set");
+            bool first = true;
+            for (auto field : get_upsert_fields<T>(it->second, fields)) {
+                if(!first)
+                    sql += ", ";
+                first = false;
+                sql += std::string(field) + "=excluded." + std::string(field);
+            }
+
+            return sql;
+        }
+
+        //update t set ... where key=?, the placeholders are numbered by the fields so insert_impl
+        //binds them. the tables without a key are still replaced.
+        template<typename T>
+        std::string generate_update_sql(){
+            auto it = key_map().find(get_name<T>());
+            size_t index = it==key_map().end() ? iguana::get_value<T>() : get_field_index<T>(it->second);
+            if(index>=iguana::get_value<T>())
+                return generate_insert_sql<T>(true);
+
+            return ormpp::generate_update_sql<T>(get_name<T>(), index, "?");
         }
 
 		template<typename  T>
-		inline std::string generate_auto_insert_sql0(std::map<std::string, std::string>& auto_key_map_, bool replace) {
+		inline std::string generate_auto_insert_sql0(std::map<std::string, std::string>& auto_keys, bool replace) {
 			std::string sql = replace ? "replace into " : "insert into ";
 			constexpr auto SIZE = iguana::get_value<T>();
 			auto name = get_name<T>();
@@ -490,10 +667,10 @@ namespace ormpp{
 
 			std::string fields = "(";
 			std::string values = " values(";
-			auto it = auto_key_map_.find(name.data());
+			auto it = auto_keys.find(name.data());
 			for (auto i = 0; i < SIZE; ++i) {
 				std::string field_name = iguana::get_name<T>(i).data();
-				 if(it!=auto_key_map_.end()&&it->second==field_name)
+				 if(it!=auto_keys.end()&&it->second==field_name)
 					 continue;
 
 				values += "?";
@@ -511,9 +688,19 @@ namespace ormpp{
 			return sql;
 		}
 
+        std::map<std::string, std::string>& auto_key_map() const{
+            return keys_->auto_key_map;
+        }
+
+        std::map<std::string, std::string>& key_map() const{
+            return keys_->key_map;
+        }
+
         sqlite3* handle_ = nullptr;
         sqlite3_stmt* stmt_ = nullptr;
-        std::map<std::string, std::string> auto_key_map_;
+        statement_cache<sqlite3_stmt> stmt_cache_;
+        //shared by the connections to the same file, so the ones which didn't create the tables know their keys
+        std::shared_ptr<table_keys> keys_ = std::make_shared<table_keys>();
 		std::string last_error_;
 //        std::string auto_key_ = "";
     };
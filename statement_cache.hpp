@@ -0,0 +1,110 @@
+#ifndef ORMPP_STATEMENT_CACHE_HPP
+#define ORMPP_STATEMENT_CACHE_HPP
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+
+namespace ormpp{
+    struct statement_cache_stats{
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
+    //bounded LRU of prepared statements keyed by the sql text.
+    //every connection owns one, so it is not thread safe, the same as the connection itself.
+    template<typename Stmt>
+    class statement_cache{
+    public:
+        using stmt_ptr = std::shared_ptr<Stmt>;
+
+        explicit statement_cache(size_t capacity = 64) : capacity_(capacity){}
+
+        //return the cached statement, or prepare a new one by fn(sql) and cache it.
+        //capacity 0 means no cache, the statement is prepared every time.
+        template<typename F>
+        stmt_ptr get_or_prepare(const std::string& sql, F&& fn){
+            auto it = index_.find(sql);
+            if(it!=index_.end()){
+                hits_++;
+                items_.splice(items_.begin(), items_, it->second);
+                return it->second->second;
+            }
+
+            misses_++;
+            stmt_ptr stmt = fn(sql);
+            if(stmt==nullptr||capacity_==0)
+                return stmt;
+
+            while(index_.size()>=capacity_){
+                evict_last();
+            }
+
+            items_.emplace_front(sql, stmt);
+            index_.emplace(sql, items_.begin());
+            return stmt;
+        }
+
+        void erase(const std::string& sql){
+            auto it = index_.find(sql);
+            if(it==index_.end())
+                return;
+
+            items_.erase(it->second);
+            index_.erase(it);
+        }
+
+        //must be called before the connection is closed or reconnected
+        void clear(){
+            index_.clear();
+            items_.clear();
+        }
+
+        void set_capacity(size_t capacity){
+            capacity_ = capacity;
+            while(index_.size()>capacity_){
+                evict_last();
+            }
+        }
+
+        size_t capacity() const{
+            return capacity_;
+        }
+
+        size_t size() const{
+            return index_.size();
+        }
+
+        statement_cache_stats stats() const{
+            return {hits_, misses_, evictions_, index_.size(), capacity_};
+        }
+
+        void reset_stats(){
+            hits_ = 0;
+            misses_ = 0;
+            evictions_ = 0;
+        }
+
+    private:
+        void evict_last(){
+            index_.erase(items_.back().first);
+            items_.pop_back();
+            evictions_++;
+        }
+
+        using item_t = std::pair<std::string, stmt_ptr>;
+        std::list<item_t> items_;
+        std::unordered_map<std::string, typename std::list<item_t>::iterator> index_;
+        size_t capacity_;
+        uint64_t hits_ = 0;
+        uint64_t misses_ = 0;
+        uint64_t evictions_ = 0;
+    };
+}
+
+#endif //ORMPP_STATEMENT_CACHE_HPP
@@ -0,0 +1,78 @@
+#ifndef ORMPP_TRACKED_HPP
+#define ORMPP_TRACKED_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include "iguana/reflection.hpp"
+
+namespace ormpp{
+    //a row and the copy of it which is in the database, the changed fields are found by comparing
+    //them, so dbng::update(tracked<T>&) only sets the changed fields. a bit for every field, in the
+    //order of the fields. the key must not be changed, it is the condition of the update, so
+    //dbng::update fails if it is.
+    template<typename T>
+    class tracked{
+    public:
+        static_assert(iguana::get_value<T>()<=64, "a tracked row has at most 64 fields");
+
+        tracked() = default;
+        explicit tracked(T t) : origin_(t), value_(std::move(t)){}
+
+        T& get(){
+            return value_;
+        }
+
+        const T& get() const{
+            return value_;
+        }
+
+        T* operator->(){
+            return &value_;
+        }
+
+        T& operator*(){
+            return value_;
+        }
+
+        //the row as it was loaded or saved last time
+        const T& origin() const{
+            return origin_;
+        }
+
+        uint64_t dirty_mask() const{
+            uint64_t mask = 0;
+            iguana::for_each(value_, [this, &mask](auto item, auto I){
+                if(!equal(value_.*item, origin_.*item))
+                    mask |= uint64_t(1)<<decltype(I)::value;
+            });
+            return mask;
+        }
+
+        bool dirty() const{
+            return dirty_mask()!=0;
+        }
+
+        //called after the row is saved
+        void reset(){
+            origin_ = value_;
+        }
+
+    private:
+        template<typename U>
+        static bool equal(const U& a, const U& b){
+            if constexpr(std::is_array_v<U>){
+                return std::equal(std::begin(a), std::end(a), std::begin(b));
+            }
+            else{
+                return a==b;
+            }
+        }
+
+        T origin_ = {};
+        T value_ = {};
+    };
+}
+
+#endif //ORMPP_TRACKED_HPP
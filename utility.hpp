@@ -5,9 +5,33 @@
 #define ORM_UTILITY_HPP
 #include "entity.hpp"
 #include "type_mapping.hpp"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "iguana/reflection.hpp"
 
 namespace ormpp{
+    //the keys of the tables in a database, shared by all the connections to it
+    struct table_keys{
+        std::map<std::string, std::string> auto_key_map;
+        //the ormpp_key or ormpp_auto_key of the tables
+        std::map<std::string, std::string> key_map;
+    };
+
+    //db names the database, such as "sqlite:" and the file, so the same table name in two databases
+    //can have different keys
+    inline std::shared_ptr<table_keys> get_table_keys(const std::string& db){
+        static std::mutex mtx;
+        static std::map<std::string, std::shared_ptr<table_keys>> keys;
+        std::unique_lock<std::mutex> lock(mtx);
+        auto& p = keys[db];
+        if(p==nullptr)
+            p = std::make_shared<table_keys>();
+        return p;
+    }
+
     template <typename ... Args>
     struct value_of;
 
@@ -163,6 +187,125 @@ namespace ormpp{
         return sql;
     }
 
+    //the index of the field, or the number of the fields if it isn't a field of T
+    template<typename T>
+    inline size_t get_field_index(std::string_view field_name){
+        constexpr auto SIZE = iguana::get_value<T>();
+        for (size_t i = 0; i < SIZE; ++i) {
+            if(iguana::get_name<T>(i)==field_name)
+                return i;
+        }
+
+        return SIZE;
+    }
+
+    //update t set a=?, b=? where key=?, the key isn't updated. with a prefix such as "$" the
+    //placeholders are numbered by the index of the field, so the fields are bound in their order.
+    template<typename T>
+    inline std::string generate_update_sql(std::string_view table, size_t key_index, std::string_view numbered_prefix = ""){
+        constexpr auto SIZE = iguana::get_value<T>();
+        auto placeholder = [numbered_prefix](size_t i){
+            return numbered_prefix.empty() ? std::string("?") : std::string(numbered_prefix) + std::to_string(i + 1);
+        };
+
+        std::string sql = "update ";
+        append(sql, table, " set ");
+        bool first = true;
+        for (size_t i = 0; i < SIZE; ++i) {
+            if(i==key_index)
+                continue;
+
+            if(!first)
+                sql += ", ";
+            first = false;
+            append(sql, iguana::get_name<T>(i).data(), "=", placeholder(i));
+        }
+
+        append(sql, " where ", iguana::get_name<T>(key_index).data(), "=", placeholder(key_index));
+        return sql;
+    }
+
+    //update t set a=?, c=? where key=? for the fields in the mask, the key is bound last. with a
+    //prefix such as "$" the placeholders are numbered in the same order.
+    template<typename T>
+    inline std::string generate_update_fields_sql(std::string_view table, size_t key_index, uint64_t mask, std::string_view numbered_prefix = ""){
+        constexpr auto SIZE = iguana::get_value<T>();
+        size_t count = 0;
+        auto placeholder = [numbered_prefix, &count]{
+            count++;
+            return numbered_prefix.empty() ? std::string("?") : std::string(numbered_prefix) + std::to_string(count);
+        };
+
+        std::string sql = "update ";
+        append(sql, table, " set ");
+        for (size_t i = 0; i < SIZE; ++i) {
+            if(i==key_index||(mask&(uint64_t(1)<<i))==0)
+                continue;
+
+            if(count>0)
+                sql += ", ";
+            append(sql, iguana::get_name<T>(i).data(), "=", placeholder());
+        }
+
+        append(sql, " where ", iguana::get_name<T>(key_index).data(), "=", placeholder());
+        return sql;
+    }
+
+    //the number of the keys in a get_many statement. the keys are padded up to it with the last key,
+    //so there are only a few statements of a table to prepare and cache.
+    inline size_t get_key_batch_size(size_t n){
+        constexpr size_t sizes[] = {1, 8, 64, 512};
+        for (auto size : sizes) {
+            if(n<=size)
+                return size;
+        }
+
+        return sizes[std::size(sizes) - 1];
+    }
+
+    //select * from t where key=? or select * from t where key in (?, ?, ...)
+    template<typename T>
+    inline std::string generate_get_sql(std::string_view table, std::string_view key, size_t count, std::string_view numbered_prefix = ""){
+        auto placeholder = [numbered_prefix](size_t i){
+            return numbered_prefix.empty() ? std::string("?") : std::string(numbered_prefix) + std::to_string(i + 1);
+        };
+
+        std::string sql = "select * from ";
+        append(sql, table, " where ", key);
+        if(count==1){
+            append(sql, "=", placeholder(0));
+            return sql;
+        }
+
+        sql += "in (";
+        for (size_t i = 0; i < count; ++i) {
+            if(i>0)
+                sql += ", ";
+            sql += placeholder(i);
+        }
+        sql += ")";
+        return sql;
+    }
+
+    //the fields updated by an upsert: the chosen ones, or all the fields except the key
+    template<typename T>
+    inline std::vector<std::string_view> get_upsert_fields(std::string_view key, const std::vector<std::string_view>& fields){
+        if(!fields.empty())
+            return fields;
+
+        constexpr auto SIZE = iguana::get_value<T>();
+        std::vector<std::string_view> v;
+        for (size_t i = 0; i < SIZE; ++i) {
+            if(iguana::get_name<T>(i)!=key)
+                v.push_back(iguana::get_name<T>(i));
+        }
+
+        //there is nothing but the key, setting the key to itself keeps the row
+        if(v.empty())
+            v.push_back(key);
+        return v;
+    }
+
 //    template <typename T>
     inline bool is_empty(const std::string& t){
         return t.empty();